@@ -0,0 +1,218 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "cache.h"
+#include "decl.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sddf/blk/queue.h>
+
+/*
+ * Set associative cache of sDDF transfer blocks, shared by all worker threads.
+ * Worker threads only switch while waiting on the block device, and a lookup or
+ * insert never waits, so no locking is needed here.
+ * Lines are replaced with the CLOCK algorithm, run separately within each set.
+ * Dirty lines are never chosen for replacement, they have to be written back first.
+ * The device may complete writes of the same block in any order, so while a line is being
+ * written it is not handed out for another write back, see fat_cache_write_start.
+ */
+
+#define FAT_CACHE_SETS (FAT_CACHE_LINES / FAT_CACHE_WAYS)
+
+_Static_assert(FAT_CACHE_SIZE % BLK_TRANSFER_SIZE == 0, "FAT_CACHE_SIZE must be a multiple of BLK_TRANSFER_SIZE");
+_Static_assert(FAT_CACHE_SETS > 0 && FAT_CACHE_LINES % FAT_CACHE_WAYS == 0,
+               "The block cache must hold a whole number of sets");
+
+// Memory region holding the cached blocks, line i is at cache_region + i * BLK_TRANSFER_SIZE
+char *cache_region;
+
+typedef struct cache_line {
+    uint64_t block;
+    // Set from next_seq on every modification, so a write can tell if the line changed while in flight.
+    // Sequence numbers are unique across lines, a line that was replaced never looks unchanged.
+    uint64_t seq;
+    bool valid;
+    bool referenced;
+    bool dirty;
+    // Set while a write of the line's data is in flight
+    bool writing;
+} cache_line_t;
+
+static cache_line_t lines[FAT_CACHE_LINES];
+static uint8_t clock_hand[FAT_CACHE_SETS];
+static uint64_t dirty_lines;
+static uint64_t next_seq;
+
+fat_cache_stats_t fat_cache_stats;
+
+static inline uint64_t set_of(uint64_t block) {
+    return block % FAT_CACHE_SETS;
+}
+
+static inline char *line_data(uint64_t line) {
+    return cache_region + line * BLK_TRANSFER_SIZE;
+}
+
+void fat_cache_init(void) {
+    memset(lines, 0, sizeof(lines));
+    memset(clock_hand, 0, sizeof(clock_hand));
+    dirty_lines = 0;
+    memset(&fat_cache_stats, 0, sizeof(fat_cache_stats));
+}
+
+static int64_t find_line(uint64_t block) {
+    uint64_t first = set_of(block) * FAT_CACHE_WAYS;
+    for (uint64_t i = first; i < first + FAT_CACHE_WAYS; i++) {
+        if (lines[i].valid && lines[i].block == block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+char *fat_cache_lookup(uint64_t block) {
+    int64_t line = find_line(block);
+    if (line < 0) {
+        fat_cache_stats.misses++;
+        return NULL;
+    }
+    fat_cache_stats.hits++;
+    lines[line].referenced = true;
+    return line_data(line);
+}
+
+char *fat_cache_peek(uint64_t block) {
+    int64_t line = find_line(block);
+    return (line < 0) ? NULL : line_data(line);
+}
+
+static int64_t choose_victim(uint64_t set) {
+    uint64_t first = set * FAT_CACHE_WAYS;
+    // Prefer an empty line, otherwise sweep the hand until an unreferenced clean line comes up
+    for (uint64_t i = first; i < first + FAT_CACHE_WAYS; i++) {
+        if (!lines[i].valid) {
+            return i;
+        }
+    }
+    // Two sweeps clear every reference bit, so if nothing is found by then all lines are dirty
+    for (uint64_t n = 0; n < 2 * FAT_CACHE_WAYS; n++) {
+        uint64_t i = first + clock_hand[set];
+        clock_hand[set] = (clock_hand[set] + 1) % FAT_CACHE_WAYS;
+        if (lines[i].dirty) {
+            continue;
+        }
+        if (!lines[i].referenced) {
+            fat_cache_stats.evictions++;
+            return i;
+        }
+        lines[i].referenced = false;
+    }
+    return -1;
+}
+
+char *fat_cache_insert(uint64_t block, const char *data) {
+    int64_t line = find_line(block);
+    if (line < 0) {
+        line = choose_victim(set_of(block));
+        if (line < 0) {
+            return NULL;
+        }
+        lines[line].block = block;
+        lines[line].valid = true;
+        lines[line].writing = false;
+    }
+    lines[line].referenced = true;
+    lines[line].seq = ++next_seq;
+    memcpy(line_data(line), data, BLK_TRANSFER_SIZE);
+    return line_data(line);
+}
+
+void fat_cache_mark_dirty(uint64_t block) {
+    int64_t line = find_line(block);
+    assert(line >= 0);
+    lines[line].seq = ++next_seq;
+    if (!lines[line].dirty) {
+        lines[line].dirty = true;
+        dirty_lines++;
+    }
+}
+
+uint64_t fat_cache_seq(uint64_t block) {
+    int64_t line = find_line(block);
+    return (line < 0) ? 0 : lines[line].seq;
+}
+
+char *fat_cache_dirty_line(uint64_t block, uint64_t *seq) {
+    int64_t line = find_line(block);
+    if (line < 0 || !lines[line].dirty || lines[line].writing) {
+        return NULL;
+    }
+    *seq = lines[line].seq;
+    return line_data(line);
+}
+
+void fat_cache_mark_clean(uint64_t block, uint64_t seq) {
+    int64_t line = find_line(block);
+    if (line >= 0 && lines[line].dirty && lines[line].seq == seq) {
+        lines[line].dirty = false;
+        dirty_lines--;
+    }
+}
+
+void fat_cache_write_start(uint64_t block) {
+    int64_t line = find_line(block);
+    assert(line >= 0);
+    lines[line].writing = true;
+}
+
+void fat_cache_write_done(uint64_t block) {
+    int64_t line = find_line(block);
+    if (line >= 0) {
+        lines[line].writing = false;
+    }
+}
+
+bool fat_cache_writing(uint64_t block) {
+    int64_t line = find_line(block);
+    return line >= 0 && lines[line].writing;
+}
+
+uint64_t fat_cache_dirty_count(void) {
+    return dirty_lines;
+}
+
+void fat_cache_discard(uint64_t block) {
+    int64_t line = find_line(block);
+    if (line < 0) {
+        return;
+    }
+    if (lines[line].dirty) {
+        dirty_lines--;
+    }
+    lines[line].valid = false;
+    lines[line].referenced = false;
+    lines[line].dirty = false;
+    lines[line].writing = false;
+}
+
+static int compare_block(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t fat_cache_collect_dirty(uint64_t *blocks, uint64_t max) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < FAT_CACHE_LINES && n < max; i++) {
+        if (lines[i].valid && lines[i].dirty && !lines[i].writing) {
+            blocks[n++] = lines[i].block;
+        }
+    }
+    qsort(blocks, n, sizeof(uint64_t), compare_block);
+    return n;
+}
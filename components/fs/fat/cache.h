@@ -0,0 +1,60 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <fat_config.h>
+#include <sddf/blk/queue.h>
+
+typedef struct fat_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} fat_cache_stats_t;
+
+extern fat_cache_stats_t fat_cache_stats;
+
+void fat_cache_init(void);
+
+// Returns the cached copy of a transfer block, or NULL if it is not in the cache
+char *fat_cache_lookup(uint64_t block);
+
+// Same as fat_cache_lookup, but does not count towards the statistics or mark the line as used
+char *fat_cache_peek(uint64_t block);
+
+// Insert or update the cached copy of a transfer block and return the line holding it.
+// Returns NULL if the block is not cached and every line it could go in is dirty.
+char *fat_cache_insert(uint64_t block, const char *data);
+
+// Record that the cached copy of a block has been modified, the block must be in the cache
+void fat_cache_mark_dirty(uint64_t block);
+
+// Returns the modification sequence number of a cached block, or 0 if the block is not cached
+uint64_t fat_cache_seq(uint64_t block);
+
+// Returns the line holding a dirty block along with its modification sequence number, or NULL if
+// the block is not dirty or is being written. Passing the sequence number to fat_cache_mark_clean once the data has
+// been written leaves the line dirty if it was modified in the meantime.
+char *fat_cache_dirty_line(uint64_t block, uint64_t *seq);
+void fat_cache_mark_clean(uint64_t block, uint64_t seq);
+
+// Mark a cached block as being written to the device until fat_cache_write_done. Until then it is
+// left out of fat_cache_dirty_line and fat_cache_collect_dirty, so no other write of the block is
+// sent that the device could complete in the wrong order.
+void fat_cache_write_start(uint64_t block);
+void fat_cache_write_done(uint64_t block);
+bool fat_cache_writing(uint64_t block);
+
+uint64_t fat_cache_dirty_count(void);
+
+// Drop a block from the cache without writing it back, for blocks no longer used by the file system
+void fat_cache_discard(uint64_t block);
+
+// Fill blocks with the numbers of up to max dirty blocks not being written, sorted in ascending order
+uint64_t fat_cache_collect_dirty(uint64_t *blocks, uint64_t max);
+
+#define FAT_CACHE_LINES (FAT_CACHE_SIZE / BLK_TRANSFER_SIZE)
@@ -8,7 +8,11 @@
 // Flag to control whether enabling debug printing
 // #define FAT_DEBUG_PRINT
 
+// Size of the client data region. When serving clients through the fs virtualiser
+// this must cover all client regions, see FS_VIRT_SERVER_DATA_REGION_SIZE
+#ifndef FAT_FS_DATA_REGION_SIZE
 #define FAT_FS_DATA_REGION_SIZE 0x4000000
+#endif
 
 // Maximum opened files
 #define FAT_MAX_OPENED_FILENUM 32
@@ -16,9 +20,99 @@
 // Maximum opened directories
 #define FAT_MAX_OPENED_DIRNUM 16
 
-// The number of worker thread, if changes are needed, initialisation of the thread pool must be changes as well
+// The number of worker threads, which is the number of requests the file system works on at once.
+// Set it to a plain number with FAT_WORKER_THREAD_NUM in the Makefile, the system file must map one
+// fat_worker_stack region per thread.
+#ifndef FAT_WORKER_THREAD_NUM
 #define FAT_WORKER_THREAD_NUM 4
+#endif
+
+#define FAT_MAX_WORKER_THREAD_NUM 16
 
 #define FAT_THREAD_NUM (FAT_WORKER_THREAD_NUM + 1)
 
 #define FAT_WORKER_THREAD_STACKSIZE 0x40000
+
+// Worker stacks are mapped this far apart, so that an unmapped guard page sits below each of them
+#define FAT_WORKER_THREAD_STACK_STRIDE (FAT_WORKER_THREAD_STACKSIZE + 0x1000)
+
+// The blk data region is shared between worker threads. Transfers are split into blk requests of at most
+// FAT_BLK_MAX_REQUEST_BLOCKS transfer blocks, or less if the free space is fragmented, and a worker thread
+// keeps up to FAT_BLK_REQUESTS_PER_THREAD of them in flight. The device queue depth is therefore up to
+// FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD rather than one request per worker thread.
+#define FAT_BLK_REQUESTS_PER_THREAD 4
+
+#define FAT_BLK_MAX_REQUEST_BLOCKS 32
+
+// Blk requests made by the worker threads while handling one notification are sorted by block before being
+// queued to the device, and reads or writes of adjacent blocks into adjacent space in the blk data region are
+// sent as one request of up to FAT_BLK_MERGE_MAX_BLOCKS transfer blocks
+#define FAT_BLK_ELEVATOR
+
+#define FAT_BLK_MERGE_MAX_BLOCKS 128
+
+// Size of the block cache memory region, must match the fat_cache memory region in the system file.
+// The cache holds whole sDDF transfer blocks (BLK_TRANSFER_SIZE bytes each).
+#define FAT_CACHE_SIZE 0x400000
+
+// Number of cache lines in each set of the block cache
+#define FAT_CACHE_WAYS 8
+
+// Reads spanning more than this many transfer blocks are served but not inserted into the cache,
+// so that streaming a large file does not flush out the FAT and directory blocks
+#define FAT_CACHE_BYPASS_BLOCKS 16
+
+// Hold written blocks in the block cache and write them to the device later, merging adjacent
+// blocks into larger requests. Dirty blocks are written back on sync, every
+// FAT_CACHE_FLUSH_INTERVAL_MS milliseconds, and whenever more than FAT_CACHE_DIRTY_HIGH lines are dirty
+#define FAT_CACHE_WRITE_BACK
+
+#define FAT_CACHE_FLUSH_INTERVAL_MS 1000
+
+#define FAT_CACHE_DIRTY_HIGH ((FAT_CACHE_SIZE / BLK_TRANSFER_SIZE) / 2)
+
+// Sequential reads of a file start asynchronous read-ahead into the block cache. The window starts at
+// FAT_READAHEAD_MIN_BLOCKS transfer blocks and doubles with every sequential read up to
+// FAT_READAHEAD_MAX_BLOCKS. Up to FAT_READAHEAD_SLOTS read-ahead requests can be in flight, using
+// whatever space in the blk data region the worker threads are not.
+#define FAT_READAHEAD
+
+#define FAT_READAHEAD_SLOTS 4
+
+#define FAT_READAHEAD_MIN_BLOCKS 4
+
+#define FAT_READAHEAD_MAX_BLOCKS 32
+
+// Random access to a file uses a cluster link map table (FatFs fast seek) so that f_lseek does not walk the
+// FAT chain from the start of the file. Tables are built the first time an open file is accessed out of order
+// and live in an arena of FAT_CLMT_ARENA_WORDS words in the fs_metadata region. A table takes two
+// words per fragment of the file plus two, tables of up to FAT_CLMT_PROBE_WORDS words are built in one pass.
+#define FAT_CLMT_ARENA_WORDS 0x20000
+
+#define FAT_CLMT_PROBE_WORDS 64
+
+// Path lookups remember where each name was found in its directory, so that resolving a path does not scan
+// every directory on the way from the start. Names longer than FAT_DCACHE_NAME_LEN - 1 characters are not cached.
+#define FAT_DCACHE_ENTRIES 512
+
+#define FAT_DCACHE_WAYS 4
+
+#define FAT_DCACHE_NAME_LEN 64
+
+// Cluster allocation on FAT16/FAT32 volumes uses a bitmap of free clusters built at mount, so appending to a
+// file does not search the FAT. The map lives in the fs_metadata region after the cluster link map tables and
+// covers volumes of up to FAT_FREEMAP_SIZE * 8 clusters. The FAT is read FAT_FREEMAP_SCAN_SIZE bytes at a
+// time while building it, which is large enough for the reads to bypass the block cache.
+#define FAT_FREEMAP_SIZE 0x40000
+
+#define FAT_FREEMAP_SCAN_SIZE 0x20000
+
+// Reads and writes of at least FAT_DIRECT_IO_MIN_SIZE bytes within a file whose clusters are contiguous go
+// straight to the disk as one run of sectors, rather than through FatFs one cluster at a time
+#define FAT_DIRECT_IO
+
+#define FAT_DIRECT_IO_MIN_SIZE 0x10000
+
+// With FAT_ZERO_COPY (set by the build system), reads of at least this many whole transfer blocks into a
+// block aligned client buffer are sent over the second blk connection, straight into the client data region
+#define FAT_ZERO_COPY_MIN_BLOCKS 4
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "ff.h"
+#include <fat_config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Directory entry cache used by FatFs path lookups (FF_USE_DCACHE).
+ * An entry maps a name within a directory, identified by the directory's start cluster, to the
+ * location of its directory entry, so resolving a path does not scan each directory from the start.
+ * FatFs rereads and checks the entry on every hit and drops the whole cache whenever a directory
+ * entry is removed, which covers unlink, rename and rmdir. Creating entries never moves existing ones.
+ * Like the block cache this is set associative, with round-robin replacement within each set.
+ * Lookups and inserts never wait, so no locking is needed between worker threads.
+ */
+
+#define FAT_DCACHE_SETS (FAT_DCACHE_ENTRIES / FAT_DCACHE_WAYS)
+
+_Static_assert(FAT_DCACHE_SETS > 0 && FAT_DCACHE_ENTRIES % FAT_DCACHE_WAYS == 0,
+               "The directory entry cache must hold a whole number of sets");
+
+typedef struct dcache_entry {
+    bool valid;
+    WORD fs_id;
+    DWORD dclust;
+    DWORD ofs;
+    DWORD blk_ofs;
+    uint32_t hash;
+    // Upper case copy of the name, FatFs names are case insensitive
+    WCHAR name[FAT_DCACHE_NAME_LEN];
+} dcache_entry_t;
+
+static dcache_entry_t entries[FAT_DCACHE_ENTRIES];
+static uint8_t next_way[FAT_DCACHE_SETS];
+
+// Hash the directory and upper case name. Returns false if the name is too long to be cached.
+static bool dcache_hash(DWORD dclust, const WCHAR *name, uint32_t *hash) {
+    uint32_t h = 2166136261u ^ dclust;
+    for (uint32_t i = 0; name[i] != 0; i++) {
+        if (i + 1 >= FAT_DCACHE_NAME_LEN) {
+            return false;
+        }
+        h = (h ^ (WCHAR)ff_wtoupper(name[i])) * 16777619u;
+    }
+    *hash = h;
+    return true;
+}
+
+static bool dcache_match(const dcache_entry_t *entry, FATFS *fs, DWORD dclust, const WCHAR *name, uint32_t hash) {
+    if (!entry->valid || entry->hash != hash || entry->fs_id != fs->id || entry->dclust != dclust) {
+        return false;
+    }
+    uint32_t i;
+    for (i = 0; name[i] != 0; i++) {
+        if (entry->name[i] != (WCHAR)ff_wtoupper(name[i])) {
+            return false;
+        }
+    }
+    return entry->name[i] == 0;
+}
+
+int ff_dcache_lookup(FATFS *fs, DWORD dclust, const WCHAR *name, DWORD *ofs, DWORD *blk_ofs) {
+    uint32_t hash;
+    if (!dcache_hash(dclust, name, &hash)) {
+        return 0;
+    }
+    dcache_entry_t *set = &entries[(hash % FAT_DCACHE_SETS) * FAT_DCACHE_WAYS];
+    for (uint32_t i = 0; i < FAT_DCACHE_WAYS; i++) {
+        if (dcache_match(&set[i], fs, dclust, name, hash)) {
+            *ofs = set[i].ofs;
+            *blk_ofs = set[i].blk_ofs;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void ff_dcache_insert(FATFS *fs, DWORD dclust, const WCHAR *name, DWORD ofs, DWORD blk_ofs) {
+    uint32_t hash;
+    if (!dcache_hash(dclust, name, &hash)) {
+        return;
+    }
+    uint32_t set_index = hash % FAT_DCACHE_SETS;
+    dcache_entry_t *set = &entries[set_index * FAT_DCACHE_WAYS];
+
+    dcache_entry_t *entry = NULL;
+    for (uint32_t i = 0; i < FAT_DCACHE_WAYS; i++) {
+        if (dcache_match(&set[i], fs, dclust, name, hash)) {
+            entry = &set[i];
+            break;
+        }
+        if (entry == NULL && !set[i].valid) {
+            entry = &set[i];
+        }
+    }
+    if (entry == NULL) {
+        entry = &set[next_way[set_index]];
+        next_way[set_index] = (next_way[set_index] + 1) % FAT_DCACHE_WAYS;
+    }
+
+    uint32_t i;
+    for (i = 0; name[i] != 0; i++) {
+        entry->name[i] = (WCHAR)ff_wtoupper(name[i]);
+    }
+    entry->name[i] = 0;
+    entry->valid = true;
+    entry->fs_id = fs->id;
+    entry->dclust = dclust;
+    entry->ofs = ofs;
+    entry->blk_ofs = blk_ofs;
+    entry->hash = hash;
+}
+
+void ff_dcache_flush(FATFS *fs) {
+    for (uint32_t i = 0; i < FAT_DCACHE_ENTRIES; i++) {
+        if (entries[i].fs_id == fs->id) {
+            entries[i].valid = false;
+        }
+    }
+}
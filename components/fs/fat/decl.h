@@ -38,6 +38,40 @@ void fat_seekdir(void);
 void fat_readdir(void);
 void fat_rewinddir(void);
 void fat_telldir(void);
+void fat_preadv(void);
+void fat_pwritev(void);
+void fat_fetch(void);
+void fat_readdir_batch(void);
+void fat_allocate(void);
+
+// Called for each completed blk request made by a worker thread, wakes the thread after the last one
+void disk_complete(uint32_t handle, uint32_t status);
+// Called for each blk response, id is the id of the sDDF request
+void fat_blk_complete(uint32_t id, uint32_t status);
+#ifdef FAT_BLK_ELEVATOR
+// Send the blk requests made since the last call to the device, call once the worker threads have blocked
+void fat_blk_submit(void);
+#endif
+
+// Build the free cluster map of a mounted volume, without it FatFs falls back to searching the FAT
+FRESULT fat_freemap_build(FATFS *fs);
+extern uint64_t *freemap_region;
+// Whether the sectors [first, last] lie in clusters that are free, false if the map cannot tell
+bool fat_freemap_sectors_free(LBA_t first, LBA_t last);
+
+#ifdef FAT_READAHEAD
+// Forget the last block read by the calling thread, call before starting a read
+void fat_readahead_reset(void);
+// Read up to window transfer blocks past the last block read by the calling thread into the block cache
+void fat_readahead(uint32_t window);
+// Called when the blk response for read-ahead slot arrives
+void fat_readahead_complete(uint32_t slot, uint32_t status);
+#endif
+
+#ifdef FAT_CACHE_WRITE_BACK
+// Not a client command, run periodically to write back dirty blocks
+void fat_cache_flush_job(void);
+#endif
 
 // For debug
 #ifdef FAT_DEBUG_PRINT
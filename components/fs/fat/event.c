@@ -6,18 +6,25 @@
 #include "decl.h"
 #include "ff.h"
 #include "diskio.h"
+#include "cache.h"
 #include <sddf/blk/queue.h>
 #include <libmicrokitco.h>
 #include <lions/fs/protocol.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <blk_config.h>
 #include <microkit.h>
 #include <assert.h>
+#ifdef FAT_CACHE_WRITE_BACK
+#include <sddf/timer/client.h>
+#endif
 
 #define CLIENT_CH 1
 #define SERVER_CH 2
+#define TIMER_CH 3
+#define BLK_ZERO_COPY_CH 4
 
 co_control_t co_controller_mem;
 microkit_cothread_sem_t sem[FAT_WORKER_THREAD_NUM + 1];
@@ -31,13 +38,46 @@ fs_queue_t *fs_completion_queue;
 blk_req_queue_t *blk_request;
 blk_resp_queue_t *blk_response;
 
+#ifdef FAT_ZERO_COPY
+// Second connection to the blk virtualiser, its data region is the client data region
+blk_queue_handle_t blk_zero_copy_queue_handle_memory;
+blk_queue_handle_t *blk_zero_copy_queue_handle = &blk_zero_copy_queue_handle_memory;
+
+blk_req_queue_t *blk_zero_copy_request;
+blk_resp_queue_t *blk_zero_copy_response;
+
+bool blk_zero_copy_request_pushed = false;
+#endif
+
 // Config pointed to the SDDF_blk config
 blk_storage_info_t *blk_config;
 
-uint64_t worker_thread_stack_one;
-uint64_t worker_thread_stack_two;
-uint64_t worker_thread_stack_three;
-uint64_t worker_thread_stack_four;
+// Base of the worker thread stacks, the stack of worker i is at
+// worker_thread_stacks + i * FAT_WORKER_THREAD_STACK_STRIDE
+uint64_t worker_thread_stacks;
+
+#define WORKER_STACK(i) (worker_thread_stacks + (i) * FAT_WORKER_THREAD_STACK_STRIDE)
+
+// The stacks of the first n worker threads, as arguments to microkit_cothread_init.
+// n has to be a plain number for the token pasting to find the right list.
+#define WORKER_STACKS_1 WORKER_STACK(0)
+#define WORKER_STACKS_2 WORKER_STACKS_1, WORKER_STACK(1)
+#define WORKER_STACKS_3 WORKER_STACKS_2, WORKER_STACK(2)
+#define WORKER_STACKS_4 WORKER_STACKS_3, WORKER_STACK(3)
+#define WORKER_STACKS_5 WORKER_STACKS_4, WORKER_STACK(4)
+#define WORKER_STACKS_6 WORKER_STACKS_5, WORKER_STACK(5)
+#define WORKER_STACKS_7 WORKER_STACKS_6, WORKER_STACK(6)
+#define WORKER_STACKS_8 WORKER_STACKS_7, WORKER_STACK(7)
+#define WORKER_STACKS_9 WORKER_STACKS_8, WORKER_STACK(8)
+#define WORKER_STACKS_10 WORKER_STACKS_9, WORKER_STACK(9)
+#define WORKER_STACKS_11 WORKER_STACKS_10, WORKER_STACK(10)
+#define WORKER_STACKS_12 WORKER_STACKS_11, WORKER_STACK(11)
+#define WORKER_STACKS_13 WORKER_STACKS_12, WORKER_STACK(12)
+#define WORKER_STACKS_14 WORKER_STACKS_13, WORKER_STACK(13)
+#define WORKER_STACKS_15 WORKER_STACKS_14, WORKER_STACK(14)
+#define WORKER_STACKS_16 WORKER_STACKS_15, WORKER_STACK(15)
+#define WORKER_STACKS_N(n) WORKER_STACKS_##n
+#define WORKER_STACKS(n) WORKER_STACKS_N(n)
 
 char *client_data_addr;
 
@@ -66,6 +106,10 @@ typedef struct FS_request{
     microkit_cothread_ref_t handle;
     /* Self metadata */
     space_status stat;
+    /* Job started by the file system itself, there is no client to reply to */
+    bool internal;
+    /* Operation run by the worker thread */
+    void (*func)(void);
 } fs_request;
 
 // This operations list must be consistent with the file system protocol enum
@@ -90,26 +134,67 @@ void (*operation_functions[])(void) = {
     [FS_CMD_DIR_SEEK] = fat_seekdir,
     [FS_CMD_DIR_TELL] = fat_telldir,
     [FS_CMD_DIR_REWIND] = fat_rewinddir,
+    [FS_CMD_FILE_READV] = fat_preadv,
+    [FS_CMD_FILE_WRITEV] = fat_pwritev,
+    [FS_CMD_FILE_FETCH] = fat_fetch,
+    [FS_CMD_DIR_READ_BATCH] = fat_readdir_batch,
+    [FS_CMD_FILE_ALLOCATE] = fat_allocate,
 };
 
 static fs_request request_pool[FAT_THREAD_NUM];
 
+// Responses written to the completion queue during this notification, published once it has been handled
+static uint32_t fs_response_enqueued;
+
+#ifdef FAT_CACHE_WRITE_BACK
+// Set when the flush timer fires, cleared once a worker thread has been given the flush job
+static bool cache_flush_pending = false;
+#endif
+
 void fill_client_response(fs_msg_t* message, const fs_request* finished_request) {
     message->cmpl.id = finished_request->request_id;
     message->cmpl.status = finished_request->shared_data.status;
     message->cmpl.data = finished_request->shared_data.result;
 }
 
+/*
+ * Every worker thread starts here. Once the operation returns, the thread writes the response straight
+ * into the completion queue, whose space was reserved when the request was dequeued, and frees its slot
+ * in the request pool. The event loop therefore never has to look for finished threads.
+ */
+static void worker_main(void) {
+    // The argument is replaced by blk responses once the operation starts, so find the request now
+    fs_request *request = (fs_request *)((char *)microkit_cothread_my_arg() - offsetof(fs_request, shared_data));
+    request->func();
+
+    if (!request->internal) {
+        fill_client_response(fs_queue_idx_empty(fs_completion_queue, fs_response_enqueued), request);
+        fs_response_enqueued++;
+        LOG_FATFS("FS enqueue response:status: %lu\n", request->shared_data.status);
+    }
+    request->stat = FREE;
+}
+
 // Setting up the request in the request_pool and push the request to the thread pool
 void setup_request(int32_t index, fs_msg_t* message) {
     request_pool[index].request_id = message->cmd.id;
     request_pool[index].cmd = message->cmd.type;
+    request_pool[index].internal = false;
     request_pool[index].shared_data.params = message->cmd.params;
-    void (*func)(void) = operation_functions[request_pool[index].cmd];
+    request_pool[index].func = operation_functions[request_pool[index].cmd];
     void *shared_data = &request_pool[index].shared_data;
-    request_pool[index].handle = microkit_cothread_spawn(func, shared_data);
+    request_pool[index].handle = microkit_cothread_spawn(worker_main, shared_data);
 }
 
+#ifdef FAT_CACHE_WRITE_BACK
+void setup_flush_job(int32_t index) {
+    request_pool[index].internal = true;
+    request_pool[index].func = fat_cache_flush_job;
+    void *shared_data = &request_pool[index].shared_data;
+    request_pool[index].handle = microkit_cothread_spawn(worker_main, shared_data);
+}
+#endif
+
 // For debug
 void print_sector_data(uint8_t *buffer, unsigned long size) {
     for (unsigned long i = 0; i < size; i++) {
@@ -121,36 +206,67 @@ void print_sector_data(uint8_t *buffer, unsigned long size) {
     LOG_FATFS("\n");
 }
 
-_Static_assert(BLK_QUEUE_CAPACITY_CLI_FAT >= FAT_WORKER_THREAD_NUM,
-    "The size of queue between fs and blk should be at least the size of FAT_WORKER_THREAD_NUM");
+_Static_assert(FAT_WORKER_THREAD_NUM >= 1 && FAT_WORKER_THREAD_NUM <= FAT_MAX_WORKER_THREAD_NUM,
+    "FAT_WORKER_THREAD_NUM must be between 1 and FAT_MAX_WORKER_THREAD_NUM");
+
+#ifdef FAT_READAHEAD
+_Static_assert(BLK_QUEUE_CAPACITY_CLI_FAT >= FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD + FAT_READAHEAD_SLOTS,
+    "The size of queue between fs and blk should be at least FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD + FAT_READAHEAD_SLOTS");
+#else
+_Static_assert(BLK_QUEUE_CAPACITY_CLI_FAT >= FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD,
+    "The size of queue between fs and blk should be at least FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD");
+#endif
+#ifdef FAT_ZERO_COPY
+_Static_assert(BLK_QUEUE_CAPACITY_CLI_FAT_ZERO_COPY >= FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD,
+    "The size of the zero copy queue between fs and blk should be at least FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD");
+#endif
 
 void init(void) {
     // Init the block device queue
     // Have to make sure who initialize this SDDF queue
     blk_queue_init(blk_queue_handle, blk_request, blk_response, BLK_QUEUE_CAPACITY_CLI_FAT);
+#ifdef FAT_ZERO_COPY
+    blk_queue_init(blk_zero_copy_queue_handle, blk_zero_copy_request, blk_zero_copy_response,
+                   BLK_QUEUE_CAPACITY_CLI_FAT_ZERO_COPY);
+#endif
     /*
        This part of the code is for setting up the thread pool by
-       assign stacks and size of the stack to the pool
+       assign stacks and size of the stack to the pool.
+       microkit_cothread_init takes one stack per worker thread as variadic arguments.
     */
-    uint64_t stack[FAT_WORKER_THREAD_NUM];
-    stack[0] = worker_thread_stack_one;
-    stack[1] = worker_thread_stack_two;
-    stack[2] = worker_thread_stack_three;
-    stack[3] = worker_thread_stack_four;
-
-    // Init thread pool
     microkit_cothread_init(&co_controller_mem,
                             FAT_WORKER_THREAD_STACKSIZE,
-                            stack[0],
-                            stack[1],
-                            stack[2],
-                            stack[3]);
+                            WORKER_STACKS(FAT_WORKER_THREAD_NUM));
     for (uint32_t i = 0; i < (FAT_WORKER_THREAD_NUM + 1); i++) {
         microkit_cothread_semaphore_init(&sem[i]);
     }
 
     // Init file system metadata
     init_metadata(fs_metadata);
+
+#ifdef FAT_CACHE_WRITE_BACK
+    sddf_timer_set_timeout(TIMER_CH, FAT_CACHE_FLUSH_INTERVAL_MS * NS_IN_MS);
+#endif
+}
+
+// Wake up the worker threads whose blk requests have completed
+static void process_blk_responses(blk_queue_handle_t *queue_handle) {
+    blk_resp_status_t status;
+    uint16_t success_count;
+    uint32_t id;
+    // Get current element numbers in blk response queue
+    uint32_t len = blk_queue_length_resp(queue_handle);
+
+    while (len > 0) {
+        int err = blk_dequeue_resp(queue_handle, &status, &success_count, &id);
+        assert(!err);
+
+        LOG_FATFS("blk_dequeue_resp: status: %d success_count: %d ID: %d\n", status, success_count, id);
+
+        fat_blk_complete(id, status);
+
+        len--;
+    }
 }
 
 // The notified function requires careful management of the state of the file system
@@ -162,6 +278,20 @@ void init(void) {
 */
 void notified(microkit_channel ch) {
     LOG_FATFS("Notification received on channel:: %d\n", ch);
+#ifdef FAT_CACHE_WRITE_BACK
+    if (ch == TIMER_CH) {
+        // Only worth taking a thread for if there is something to write back
+        if (fat_cache_dirty_count() > 0) {
+            cache_flush_pending = true;
+        }
+        sddf_timer_set_timeout(TIMER_CH, FAT_CACHE_FLUSH_INTERVAL_MS * NS_IN_MS);
+    } else
+#endif
+#ifdef FAT_ZERO_COPY
+    if (ch == BLK_ZERO_COPY_CH) {
+        // Responses are picked up below along with those from SERVER_CH
+    } else
+#endif
     if (ch != CLIENT_CH && ch != SERVER_CH) {
         LOG_FATFS("Unknown channel:%d\n", ch);
         return;
@@ -176,56 +306,36 @@ void notified(microkit_channel ch) {
     uint64_t completion_queue_size;
 
     uint32_t fs_request_dequeued = 0;
-    uint32_t fs_response_enqueued = 0;
 
     while (new_request_popped) {
-        {
-            blk_resp_status_t status;
-            uint16_t success_count;
-            uint32_t id;
-            // Get current element numbers in blk response queue
-            uint32_t len = blk_queue_length_resp(blk_queue_handle);
-
-            while (len > 0) {
-                // This id is the index to the request pool
-                int err = blk_dequeue_resp(blk_queue_handle, &status, &success_count, &id);
-                assert(!err);
-
-                LOG_FATFS("blk_dequeue_resp: status: %d success_count: %d ID: %d\n", status, success_count, id);
-
-                microkit_cothread_set_arg(request_pool[id].handle, (void *)status);
-                microkit_cothread_semaphore_signal(&sem[request_pool[id].handle]);
-
-                len--;
-            }
-        }
-
-        // Give worker threads a chance to run
-        microkit_cothread_yield();
+        process_blk_responses(blk_queue_handle);
+#ifdef FAT_ZERO_COPY
+        process_blk_responses(blk_zero_copy_queue_handle);
+#endif
 
         /**
-        If the code below get executed, then all the working threads are either blocked or finished.
-        So the code below would send the result back to client through SDDF and do the cleanup for finished
-        threads. After that, the main thread would block wait on new requests or server sending responses.
+        Give worker threads a chance to run. When this returns all the working threads are either blocked
+        or finished, and the finished ones have already written their responses, see worker_main.
         **/
-        /*
-          This for loop check if there are threads finished and send the result back
-        */
-        for (uint16_t i = 1; i < FAT_THREAD_NUM; i++) {
-            co_state_t state = microkit_cothread_query_state(request_pool[i].handle);
-            if (state == cothread_not_active && request_pool[i].stat == INUSE) {
-                fill_client_response(fs_queue_idx_empty(fs_completion_queue, fs_response_enqueued), &(request_pool[i]));
-                fs_response_enqueued++;
-                LOG_FATFS("FS enqueue response:status: %lu\n", request_pool[i].shared_data.status);
-                request_pool[i].stat= FREE;
-            }
-        }
+        microkit_cothread_yield();
 
         /*
           This should pop the request from the command_queue to the thread pool to execute, if no new request is
           popped, we should exit the whole while loop.
         */
         new_request_popped = false;
+#ifdef FAT_CACHE_WRITE_BACK
+        {
+            microkit_cothread_ref_t index;
+            if (cache_flush_pending && microkit_cothread_free_handle_available(&index)) {
+                setup_flush_job(index);
+                request_pool[index].stat = INUSE;
+                cache_flush_pending = false;
+                // Go round again so the flush job gets to run and submit its requests
+                new_request_popped = true;
+            }
+        }
+#endif
         while (true) {
             microkit_cothread_ref_t index;
             // If there is space and we do not know the size of the queue, get it now
@@ -270,11 +380,21 @@ void notified(microkit_channel ch) {
     if (fs_response_enqueued) {
         LOG_FATFS("FS notify client\n");
         fs_queue_publish_production(fs_completion_queue, fs_response_enqueued);
+        fs_response_enqueued = 0;
         microkit_notify(CLIENT_CH);
     }
+#ifdef FAT_BLK_ELEVATOR
+    fat_blk_submit();
+#endif
     if (blk_request_pushed) {
         LOG_FATFS("FS notify driver\n");
         microkit_notify(SERVER_CH);
         blk_request_pushed = false;
     }
+#ifdef FAT_ZERO_COPY
+    if (blk_zero_copy_request_pushed) {
+        microkit_notify(BLK_ZERO_COPY_CH);
+        blk_zero_copy_request_pushed = false;
+    }
+#endif
 }
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "decl.h"
+#include "ff.h"
+#include "diskio.h"
+#include <fat_config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sddf/util/util.h>
+
+/*
+ * Free cluster map used by FatFs cluster allocation on FAT16/FAT32 volumes (FF_USE_FREEMAP).
+ * One bit per cluster, set when the cluster's FAT entry is non-zero. The map is built from the FAT
+ * at mount and FatFs reports every FAT entry it writes through ff_freemap_set, so finding a free
+ * cluster never has to read the FAT. FAT12 and exFAT volumes, and volumes with more clusters than
+ * the map can hold, are left to FatFs. exFAT has its own allocation bitmap on disk.
+ */
+
+#define FREEMAP_MAX_CLUSTERS ((uint64_t)FAT_FREEMAP_SIZE * 8)
+
+// Set up by init_metadata, FAT_FREEMAP_SIZE bytes in the metadata region
+uint64_t *freemap_region;
+
+static FATFS *freemap_fs;
+static bool freemap_valid;
+static bool freemap_building;
+static bool freemap_changed;
+static WORD freemap_fs_id;
+
+static BYTE scan_buf[FAT_FREEMAP_SCAN_SIZE];
+
+static inline bool freemap_ready(FATFS *fs) {
+    return freemap_valid && fs->id == freemap_fs_id;
+}
+
+static inline void freemap_mark(DWORD clst, bool used) {
+    if (used) {
+        freemap_region[clst / 64] |= 1ull << (clst % 64);
+    } else {
+        freemap_region[clst / 64] &= ~(1ull << (clst % 64));
+    }
+}
+
+FRESULT fat_freemap_build(FATFS *fs) {
+    freemap_valid = false;
+    if ((fs->fs_type != FS_FAT16 && fs->fs_type != FS_FAT32) || fs->n_fatent > FREEMAP_MAX_CLUSTERS) {
+        return FR_INVALID_PARAMETER;
+    }
+
+    uint32_t entry_size = (fs->fs_type == FS_FAT16) ? 2 : 4;
+    uint32_t entries_per_chunk = FAT_FREEMAP_SCAN_SIZE / entry_size;
+    uint32_t sectors_per_chunk = FAT_FREEMAP_SCAN_SIZE / fs->ssize;
+    DWORD free_clusters = 0;
+
+    // Clusters 0 and 1 and the bits past the last cluster are never free
+    memset(freemap_region, 0xFF, (fs->n_fatent + 63) / 64 * sizeof(uint64_t));
+    freemap_building = true;
+    freemap_changed = false;
+
+    for (DWORD first = 0; first < fs->n_fatent; first += entries_per_chunk) {
+        LBA_t sector = fs->fatbase + (LBA_t)first * entry_size / fs->ssize;
+        uint32_t count = MIN(sectors_per_chunk, fs->fsize - (sector - fs->fatbase));
+        if (disk_read(fs->pdrv, scan_buf, sector, count) != RES_OK) {
+            freemap_building = false;
+            return FR_DISK_ERR;
+        }
+        DWORD last = MIN(first + entries_per_chunk, fs->n_fatent);
+        for (DWORD clst = MAX(first, 2); clst < last; clst++) {
+            // FAT entries are little endian, an entry is free if all of its bytes are zero
+            BYTE *entry = scan_buf + (clst - first) * entry_size;
+            bool used = entry[0] | entry[1];
+            if (entry_size == 4) {
+                used = used || entry[2] || (entry[3] & 0x0F);
+            }
+            if (!used) {
+                freemap_mark(clst, false);
+                free_clusters++;
+            }
+        }
+    }
+    freemap_building = false;
+
+    // The FAT read from the disk does not include entries written while we were waiting on it
+    if (freemap_changed) {
+        return FR_INT_ERR;
+    }
+    freemap_fs = fs;
+    freemap_fs_id = fs->id;
+    freemap_valid = true;
+    fs->free_clst = free_clusters;
+    LOG_FATFS("fat_freemap_build: %u of %u clusters free\n", free_clusters, fs->n_fatent - 2);
+    return FR_OK;
+}
+
+// First free cluster in [from, to), or 0 if there is none
+static DWORD freemap_search(DWORD from, DWORD to) {
+    DWORD clst = from;
+    while (clst < to) {
+        uint64_t free = ~freemap_region[clst / 64] & (UINT64_MAX << (clst % 64));
+        if (free != 0) {
+            DWORD found = (clst & ~63u) + __builtin_ctzll(free);
+            return (found < to) ? found : 0;
+        }
+        clst = (clst & ~63u) + 64;
+    }
+    return 0;
+}
+
+DWORD ff_freemap_find(FATFS *fs, DWORD scl) {
+    if (!freemap_ready(fs)) {
+        return 1;
+    }
+    // Search after the suggested cluster first, then wrap around
+    DWORD clst = freemap_search(scl + 1, fs->n_fatent);
+    if (clst == 0) {
+        clst = freemap_search(2, MIN(scl + 1, fs->n_fatent));
+    }
+    return clst;
+}
+
+void ff_freemap_set(FATFS *fs, DWORD clst, int used) {
+    if (freemap_building) {
+        freemap_changed = true;
+    }
+    if (freemap_ready(fs)) {
+        freemap_mark(clst, used);
+    }
+}
+
+bool fat_freemap_sectors_free(LBA_t first, LBA_t last) {
+    FATFS *fs = freemap_fs;
+    if (!freemap_valid || fs->id != freemap_fs_id || first < fs->database) {
+        return false;
+    }
+    LBA_t first_clst = (first - fs->database) / fs->csize + 2;
+    LBA_t last_clst = (last - fs->database) / fs->csize + 2;
+    if (last_clst >= fs->n_fatent) {
+        return false;
+    }
+    for (LBA_t clst = first_clst; clst <= last_clst; clst++) {
+        if (freemap_region[clst / 64] & (1ull << (clst % 64))) {
+            return false;
+        }
+    }
+    return true;
+}
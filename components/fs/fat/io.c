@@ -6,10 +6,12 @@
 #include "ff.h"
 #include "diskio.h"
 #include "decl.h"
+#include "cache.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <sddf/blk/queue.h>
 #include <string.h>
+#include <microkit.h>
 #include <libmicrokitco.h>
 #include <blk_config.h>
 #include <sddf/util/util.h>
@@ -19,6 +21,12 @@ extern blk_queue_handle_t *blk_queue_handle;
 
 extern bool blk_request_pushed;
 
+#ifdef FAT_ZERO_COPY
+extern blk_queue_handle_t *blk_zero_copy_queue_handle;
+extern bool blk_zero_copy_request_pushed;
+extern char *client_data_addr;
+#endif
+
 // This is the offset of the data buffer shared between file system and blk device driver
 extern uint64_t fs_metadata;
 
@@ -27,31 +35,616 @@ extern blk_storage_info_t *blk_config;
 extern char *blk_data_region;
 
 /*
- *  This def restrict the maximum cluster size that the fatfs can have
- *  This restriction should not cause any problem as long as the BLK_REGION_SIZE between file system and blk virt is not
- *  too small. For example, 32GB - 256TB disks are recommended to have a sector size of 128KB, and if you have 4 worker threads,
- *  BLK_REGION_SIZE should be bigger than 512KB. In fileio example, BLK_REGION_SIZE is set to 2 MB.
+ * The blk data region is shared by all worker threads and read-ahead. It is handed out in transfer blocks
+ * by a first fit allocator, so a thread can use most of the region when the others are idle. A transfer
+ * that does not fit in the free space is split into several requests, up to FAT_BLK_REQUESTS_PER_THREAD
+ * of which are in flight together, and the rest are issued as those complete.
  */
-#define MAX_CLUSTER_SIZE (BLK_REGION_SIZE / FAT_WORKER_THREAD_NUM)
+#define BLK_REGION_BLOCKS (BLK_REGION_SIZE / BLK_TRANSFER_SIZE)
+
+static uint64_t blk_region_bitmap[(BLK_REGION_BLOCKS + 63) / 64];
+
+// Bitmap of worker thread handles waiting for space in the blk data region
+static uint32_t blk_region_waiters;
 
-uint64_t thread_blk_addr[FAT_WORKER_THREAD_NUM];
+// Outstanding blk requests of each thread, the thread is woken when all of them have completed
+static uint32_t thread_pending[FAT_THREAD_NUM];
+static blk_resp_status_t thread_status[FAT_THREAD_NUM];
+
+extern microkit_cothread_sem_t sem[FAT_WORKER_THREAD_NUM + 1];
 
 #define IS_POWER_OF_2(x) ((x) && !((x) & ((x) - 1)))
+#define MOD_POWER_OF_2(a, b) ((a) & ((b) - 1))
+#define DIV_POWER_OF_2(a, b) ((a) >> (__builtin_ctz(b)))
+#define MUL_POWER_OF_2(a, b) ((a) << (__builtin_ctz(b)))
+
+#ifdef FAT_CACHE_WRITE_BACK
+static DRESULT fat_cache_flush(void);
+#endif
+
+static inline bool region_block_used(uint32_t block) {
+    return blk_region_bitmap[block / 64] & (1ULL << (block % 64));
+}
+
+/*
+ * Allocate up to want contiguous blocks of the blk data region. The first free run long enough is used,
+ * if there is none the longest free run is. Returns the number of blocks allocated, 0 if the region is full.
+ */
+static uint32_t region_alloc(uint32_t want, uint32_t *first) {
+    uint32_t best_start = 0, best_len = 0;
+    uint32_t block = 0;
+    while (block < BLK_REGION_BLOCKS && best_len < want) {
+        if (region_block_used(block)) {
+            block++;
+            continue;
+        }
+        uint32_t start = block;
+        while (block < BLK_REGION_BLOCKS && !region_block_used(block) && block - start < want) {
+            block++;
+        }
+        if (block - start > best_len) {
+            best_start = start;
+            best_len = block - start;
+        }
+    }
+    for (uint32_t i = best_start; i < best_start + best_len; i++) {
+        blk_region_bitmap[i / 64] |= 1ULL << (i % 64);
+    }
+    *first = best_start;
+    return best_len;
+}
+
+// Same as region_alloc, but waits for space to be freed rather than returning 0
+static uint32_t region_alloc_wait(uint32_t want, uint32_t *first) {
+    uint32_t got;
+    while ((got = region_alloc(want, first)) == 0) {
+        blk_region_waiters |= 1 << microkit_cothread_my_handle();
+        microkit_cothread_semaphore_wait(&sem[microkit_cothread_my_handle()]);
+    }
+    return got;
+}
+
+static void region_free(uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; i++) {
+        blk_region_bitmap[i / 64] &= ~(1ULL << (i % 64));
+    }
+    for (uint32_t handle = 1; handle <= FAT_WORKER_THREAD_NUM; handle++) {
+        if (blk_region_waiters & (1 << handle)) {
+            microkit_cothread_semaphore_signal(&sem[handle]);
+        }
+    }
+    blk_region_waiters = 0;
+}
+
+static inline char *region_addr(uint32_t block) {
+    return blk_data_region + MUL_POWER_OF_2((uint64_t)block, BLK_TRANSFER_SIZE);
+}
+
+#ifdef FAT_BLK_ELEVATOR
+/*
+ * Requests made while the worker threads run are held back and submitted together by fat_blk_submit
+ * once they have all blocked, sorted by block so the device sees them in ascending order. Reads or writes
+ * that follow each other both on the device and in the data region become one sDDF request, and its
+ * response completes each of them. Flushes are never merged and nothing is moved across one.
+ */
+#ifdef FAT_ZERO_COPY
+#define BLK_STAGED_MAX (BLK_QUEUE_CAPACITY_CLI_FAT + BLK_QUEUE_CAPACITY_CLI_FAT_ZERO_COPY)
+#else
+#define BLK_STAGED_MAX BLK_QUEUE_CAPACITY_CLI_FAT
+#endif
+
+#define BLK_STAGED_NONE UINT32_MAX
+
+// Every worker thread and read-ahead slot can have its own requests outstanding on each queue at once
+#ifdef FAT_READAHEAD
+#define BLK_STAGED_NEEDED_CLI_FAT (FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD + FAT_READAHEAD_SLOTS)
+#else
+#define BLK_STAGED_NEEDED_CLI_FAT (FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD)
+#endif
+#ifdef FAT_ZERO_COPY
+#define BLK_STAGED_NEEDED (BLK_STAGED_NEEDED_CLI_FAT + FAT_WORKER_THREAD_NUM * FAT_BLK_REQUESTS_PER_THREAD)
+#else
+#define BLK_STAGED_NEEDED BLK_STAGED_NEEDED_CLI_FAT
+#endif
+
+_Static_assert(BLK_STAGED_MAX >= BLK_STAGED_NEEDED,
+    "The blk queues must have room for every request that can be outstanding, as each takes a staging slot");
+
+_Static_assert(FAT_BLK_MERGE_MAX_BLOCKS >= FAT_BLK_MAX_REQUEST_BLOCKS && FAT_BLK_MERGE_MAX_BLOCKS <= UINT16_MAX,
+    "FAT_BLK_MERGE_MAX_BLOCKS must be between FAT_BLK_MAX_REQUEST_BLOCKS and UINT16_MAX");
+
+typedef struct blk_staged {
+    bool used;
+    blk_queue_handle_t *queue;
+    bool *pushed;
+    blk_req_code_t code;
+    uint64_t offset;
+    uint64_t block;
+    uint16_t count;
+    // Thread handle, or FAT_THREAD_NUM + slot for read-ahead
+    uint32_t owner;
+    // Next request sent as part of the same sDDF request
+    uint32_t next;
+} blk_staged_t;
 
+// A staged request stays allocated until its response arrives, the sDDF request id is the index of the first
+static blk_staged_t blk_staged[BLK_STAGED_MAX];
+
+// Staged requests not yet submitted, in the order they were made
+static uint32_t blk_pending[BLK_STAGED_MAX];
+static uint32_t blk_pending_num;
+#endif
+
+// Set once the last flush requested has been sent to the device, see disk_flush
+static bool blk_flush_sent;
+
+static void blk_request(blk_queue_handle_t *queue, bool *pushed, blk_req_code_t code, uint64_t offset,
+                        uint64_t block, uint16_t count, uint32_t owner) {
+#ifdef FAT_BLK_ELEVATOR
+    // Each request would otherwise have taken a queue entry, so there is always a free one
+    uint32_t i;
+    for (i = 0; i < BLK_STAGED_MAX && blk_staged[i].used; i++);
+    if (i == BLK_STAGED_MAX) {
+        microkit_dbg_puts("FATFS|ERROR: no free blk staging slot\n");
+        __builtin_trap();
+    }
+    blk_staged[i] = (blk_staged_t) {
+        .used = true,
+        .queue = queue,
+        .pushed = pushed,
+        .code = code,
+        .offset = offset,
+        .block = block,
+        .count = count,
+        .owner = owner,
+        .next = BLK_STAGED_NONE,
+    };
+    blk_pending[blk_pending_num++] = i;
+#else
+    int err = blk_enqueue_req(queue, code, offset, block, count, owner);
+    assert(!err);
+    *pushed = true;
+    if (code == BLK_REQ_FLUSH) {
+        blk_flush_sent = true;
+    }
+#endif
+}
+
+// Queue a blk request on behalf of the calling thread, see wait_for_blk_resp
+static void enqueue_req(blk_queue_handle_t *queue, bool *pushed, blk_req_code_t code, uint64_t offset,
+                        uint32_t block, uint16_t count) {
+    microkit_cothread_ref_t handle = microkit_cothread_my_handle();
+    if (thread_pending[handle] == 0) {
+        thread_status[handle] = BLK_RESP_OK;
+    }
+    blk_request(queue, pushed, code, offset, block, count, handle);
+    thread_pending[handle]++;
+}
+
+// Wait for all blk requests queued by the calling thread, the result is then in the thread's argument
 void wait_for_blk_resp() {
-    extern microkit_cothread_sem_t sem[FAT_WORKER_THREAD_NUM + 1];
     microkit_cothread_ref_t handle = microkit_cothread_my_handle();
     microkit_cothread_semaphore_wait(&sem[handle]);
 }
 
+void disk_complete(uint32_t handle, uint32_t status) {
+    assert(thread_pending[handle] > 0);
+    if (thread_status[handle] == BLK_RESP_OK) {
+        thread_status[handle] = status;
+    }
+    thread_pending[handle]--;
+    if (thread_pending[handle] == 0) {
+        microkit_cothread_set_arg(handle, (void *)thread_status[handle]);
+        microkit_cothread_semaphore_signal(&sem[handle]);
+    }
+}
+
+typedef struct blk_chunk {
+    // Position of the chunk in the transfer and in the blk data region, in transfer blocks
+    uint32_t index;
+    uint32_t region_block;
+    uint32_t count;
+} blk_chunk_t;
+
+/*
+ * Allocate space for the next part of a transfer of remaining blocks, starting at index. Waits for
+ * space if the region is full, then takes whatever else is free without waiting. The transfer is split
+ * into chunks of at most FAT_BLK_MAX_REQUEST_BLOCKS so that the device has several requests to work on.
+ * Returns the number of chunks.
+ */
+static uint32_t alloc_chunks(uint32_t index, uint32_t remaining, blk_chunk_t *chunks) {
+    uint32_t n = 0;
+    while (remaining > 0 && n < FAT_BLK_REQUESTS_PER_THREAD) {
+        uint32_t first;
+        uint32_t want = MIN(remaining, FAT_BLK_MAX_REQUEST_BLOCKS);
+        uint32_t got = (n == 0) ? region_alloc_wait(want, &first) : region_alloc(want, &first);
+        if (got == 0) {
+            break;
+        }
+        chunks[n].index = index;
+        chunks[n].region_block = first;
+        chunks[n].count = got;
+        index += got;
+        remaining -= got;
+        n++;
+    }
+    return n;
+}
+
+// Read a single transfer block from the device into dst
+static DRESULT read_block(uint32_t block, char *dst) {
+    uint32_t first;
+    region_alloc_wait(1, &first);
+    enqueue_req(blk_queue_handle, &blk_request_pushed, BLK_REQ_READ, MUL_POWER_OF_2((uint64_t)first, BLK_TRANSFER_SIZE), block, 1);
+    wait_for_blk_resp();
+    DRESULT res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
+    if (res == RES_OK) {
+        memcpy(dst, region_addr(first), BLK_TRANSFER_SIZE);
+    }
+    region_free(first, 1);
+    return res;
+}
+
+#ifdef FAT_READAHEAD
+#define NO_BLOCK UINT64_MAX
+
+typedef struct readahead_slot {
+    bool busy;
+    // Set if the blocks were written while the read was in flight, the data read is then stale
+    bool stale;
+    uint64_t block;
+    uint32_t count;
+    // Where the blocks are read to in the blk data region
+    uint32_t region_block;
+    // Bitmap of worker thread handles waiting for this read to complete
+    uint32_t waiters;
+} readahead_slot_t;
+
+static readahead_slot_t readahead_slots[FAT_READAHEAD_SLOTS];
+
+// The last transfer block read by each worker thread, read-ahead continues on from here
+static uint64_t thread_last_block[FAT_WORKER_THREAD_NUM];
+
+static readahead_slot_t *readahead_find(uint64_t first_block, uint64_t block_count) {
+    for (uint32_t i = 0; i < FAT_READAHEAD_SLOTS; i++) {
+        readahead_slot_t *ra = &readahead_slots[i];
+        if (ra->busy && ra->block < first_block + block_count && first_block < ra->block + ra->count) {
+            return ra;
+        }
+    }
+    return NULL;
+}
+
+// Wait for a read-ahead covering any of the blocks to complete. Returns false if there is none.
+static bool readahead_wait(uint64_t first_block, uint64_t block_count) {
+    readahead_slot_t *ra = readahead_find(first_block, block_count);
+    if (ra == NULL) {
+        return false;
+    }
+    ra->waiters |= 1 << microkit_cothread_my_handle();
+    microkit_cothread_semaphore_wait(&sem[microkit_cothread_my_handle()]);
+    return true;
+}
+
+// Make sure in flight read-ahead does not put old copies of blocks about to be written into the cache
+static void readahead_cancel(uint64_t first_block, uint64_t block_count) {
+    for (uint32_t i = 0; i < FAT_READAHEAD_SLOTS; i++) {
+        readahead_slot_t *ra = &readahead_slots[i];
+        if (ra->busy && ra->block < first_block + block_count && first_block < ra->block + ra->count) {
+            ra->stale = true;
+        }
+    }
+}
+
+void fat_readahead_reset(void) {
+    thread_last_block[microkit_cothread_my_handle() - 1] = NO_BLOCK;
+}
+
+void fat_readahead(uint32_t window) {
+    uint64_t last_block = thread_last_block[microkit_cothread_my_handle() - 1];
+    if (last_block == NO_BLOCK) {
+        return;
+    }
+
+    uint64_t block = last_block + 1;
+    uint64_t end = MIN(block + MIN(window, FAT_READAHEAD_MAX_BLOCKS), blk_config->capacity);
+    // Only read what is not already cached or on its way, so sequential reads top up the window
+    while (block < end && (fat_cache_peek(block) != NULL || readahead_find(block, 1) != NULL)) {
+        block++;
+    }
+    if (block >= end) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < FAT_READAHEAD_SLOTS; i++) {
+        readahead_slot_t *ra = &readahead_slots[i];
+        if (ra->busy) {
+            continue;
+        }
+        // Read-ahead never waits for space, it only makes use of what is free
+        uint32_t first;
+        uint32_t got = region_alloc(end - block, &first);
+        if (got == 0) {
+            return;
+        }
+        ra->busy = true;
+        ra->stale = false;
+        ra->block = block;
+        ra->count = got;
+        ra->region_block = first;
+        ra->waiters = 0;
+
+        LOG_FATFS("fat_readahead: block: %lu, count: %u, slot: %u\n", ra->block, ra->count, i);
+        blk_request(blk_queue_handle, &blk_request_pushed, BLK_REQ_READ, MUL_POWER_OF_2((uint64_t)first, BLK_TRANSFER_SIZE),
+                    ra->block, ra->count, FAT_THREAD_NUM + i);
+        return;
+    }
+    // All slots busy, the reader is already far enough ahead
+}
+
+void fat_readahead_complete(uint32_t slot, uint32_t status) {
+    readahead_slot_t *ra = &readahead_slots[slot];
+    assert(ra->busy);
+
+    if (status == BLK_RESP_OK && !ra->stale) {
+        char *region = region_addr(ra->region_block);
+        for (uint32_t i = 0; i < ra->count; i++) {
+            // Anything already cached is at least as new as what was read
+            if (fat_cache_peek(ra->block + i) == NULL) {
+                fat_cache_insert(ra->block + i, region + MUL_POWER_OF_2(i, BLK_TRANSFER_SIZE));
+            }
+        }
+    }
+
+    ra->busy = false;
+    region_free(ra->region_block, ra->count);
+    for (uint32_t handle = 1; handle <= FAT_WORKER_THREAD_NUM; handle++) {
+        if (ra->waiters & (1 << handle)) {
+            microkit_cothread_semaphore_signal(&sem[handle]);
+        }
+    }
+    ra->waiters = 0;
+}
+#endif
+
+/*
+ * Demand reads in flight on each worker thread. A write sent to the device while a read is in flight
+ * can land before it, so the data read may be older than the write and is then not put in the cache.
+ */
+typedef struct demand_read {
+    uint64_t block;
+    uint32_t count;
+    bool stale;
+} demand_read_t;
+
+static demand_read_t demand_reads[FAT_WORKER_THREAD_NUM];
+
+// Called before writing blocks to the device, so reads already in flight do not cache old copies of them
+static void blocks_written(uint64_t first_block, uint64_t block_count) {
+#ifdef FAT_READAHEAD
+    readahead_cancel(first_block, block_count);
+#endif
+    for (uint32_t i = 0; i < FAT_WORKER_THREAD_NUM; i++) {
+        demand_read_t *rd = &demand_reads[i];
+        if (rd->block < first_block + block_count && first_block < rd->block + rd->count) {
+            rd->stale = true;
+        }
+    }
+}
+
+// Bitmap of worker thread handles waiting for cached blocks being written to the device
+static uint32_t line_write_waiters;
+
+static void line_write_wait(void) {
+    line_write_waiters |= 1 << microkit_cothread_my_handle();
+    microkit_cothread_semaphore_wait(&sem[microkit_cothread_my_handle()]);
+}
+
+// Called once writes started with fat_cache_write_start are done, waiters then check their blocks again
+static void line_writes_done(void) {
+    for (uint32_t handle = 1; handle <= FAT_WORKER_THREAD_NUM; handle++) {
+        if (line_write_waiters & (1 << handle)) {
+            microkit_cothread_semaphore_signal(&sem[handle]);
+        }
+    }
+    line_write_waiters = 0;
+}
+
+static bool blocks_writing(uint64_t first_block, uint64_t block_count) {
+    for (uint64_t block = first_block; block < first_block + block_count; block++) {
+        if (fat_cache_writing(block)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void blk_complete_owner(uint32_t owner, uint32_t status) {
+#ifdef FAT_READAHEAD
+    // Owners past the worker threads are read-ahead slots, which no thread is blocked on
+    if (owner >= FAT_THREAD_NUM) {
+        fat_readahead_complete(owner - FAT_THREAD_NUM, status);
+        return;
+    }
+#endif
+    disk_complete(owner, status);
+}
+
+#ifdef FAT_BLK_ELEVATOR
+static inline bool blk_staged_before(const blk_staged_t *a, const blk_staged_t *b) {
+    if (a->queue != b->queue) {
+        return (uintptr_t)a->queue < (uintptr_t)b->queue;
+    }
+    return a->block < b->block;
+}
+
+// Whether next can be sent in the same sDDF request as head, which currently covers count blocks
+static inline bool blk_staged_mergeable(const blk_staged_t *head, uint32_t count, const blk_staged_t *next) {
+    return next->queue == head->queue && next->code == head->code
+        && next->block == head->block + count
+        && next->offset == head->offset + MUL_POWER_OF_2((uint64_t)count, BLK_TRANSFER_SIZE)
+        && count + next->count <= FAT_BLK_MERGE_MAX_BLOCKS;
+}
+
+void fat_blk_submit(void) {
+    uint32_t start = 0;
+    while (start < blk_pending_num) {
+        // Only requests between flushes are reordered, a flush covers everything queued before it
+        uint32_t end = start;
+        while (end < blk_pending_num && blk_staged[blk_pending[end]].code != BLK_REQ_FLUSH) {
+            end++;
+        }
+
+        // There are few enough requests that insertion sort does fine
+        for (uint32_t i = start + 1; i < end; i++) {
+            uint32_t req = blk_pending[i];
+            uint32_t j = i;
+            while (j > start && blk_staged_before(&blk_staged[req], &blk_staged[blk_pending[j - 1]])) {
+                blk_pending[j] = blk_pending[j - 1];
+                j--;
+            }
+            blk_pending[j] = req;
+        }
+
+        uint32_t i = start;
+        while (i < end) {
+            uint32_t head = blk_pending[i++];
+            blk_staged_t *req = &blk_staged[head];
+            uint32_t count = req->count;
+            uint32_t tail = head;
+            while (i < end && blk_staged_mergeable(req, count, &blk_staged[blk_pending[i]])) {
+                blk_staged[tail].next = blk_pending[i];
+                tail = blk_pending[i++];
+                count += blk_staged[tail].count;
+            }
+            LOG_FATFS("fat_blk_submit: code: %d block: %lu count: %u\n", req->code, req->block, count);
+            int err = blk_enqueue_req(req->queue, req->code, req->offset, req->block, count, head);
+            assert(!err);
+            *req->pushed = true;
+        }
+
+        if (end < blk_pending_num) {
+            blk_staged_t *req = &blk_staged[blk_pending[end]];
+            int err = blk_enqueue_req(req->queue, req->code, req->offset, req->block, req->count, blk_pending[end]);
+            assert(!err);
+            *req->pushed = true;
+            blk_flush_sent = true;
+            end++;
+        }
+        start = end;
+    }
+    blk_pending_num = 0;
+}
+
+void fat_blk_complete(uint32_t id, uint32_t status) {
+    while (id != BLK_STAGED_NONE) {
+        blk_staged_t *req = &blk_staged[id];
+        assert(req->used);
+        req->used = false;
+        id = req->next;
+        blk_complete_owner(req->owner, status);
+    }
+}
+#else
+void fat_blk_complete(uint32_t id, uint32_t status) {
+    blk_complete_owner(id, status);
+}
+#endif
+
+/*
+ * Syncs are committed in groups, so that threads syncing at the same time share one device flush.
+ * A thread that finds a flush not yet sent to the device joins it, which with FAT_BLK_ELEVATOR is any
+ * flush requested while handling the same notification. A flush already sent may not cover writes
+ * that completed after it, so a thread that finds one queues for the next, which the first of the
+ * queued threads sends on behalf of all of them once the current one completes.
+ */
+static bool blk_flush_busy;
+// Bitmaps of thread handles waiting for the current flush, and for the one after it
+static uint32_t blk_flush_waiters;
+static uint32_t blk_flush_queued;
+// Thread that is to send the next flush
+static uint32_t blk_flush_leader;
+static DRESULT blk_flush_result[FAT_THREAD_NUM];
+
+static DRESULT disk_flush(void) {
+    microkit_cothread_ref_t handle = microkit_cothread_my_handle();
+    if (blk_flush_busy) {
+        if (!blk_flush_sent) {
+            LOG_FATFS("disk_flush: joining flush\n");
+            blk_flush_waiters |= 1 << handle;
+            microkit_cothread_semaphore_wait(&sem[handle]);
+            return blk_flush_result[handle];
+        }
+        blk_flush_queued |= 1 << handle;
+        microkit_cothread_semaphore_wait(&sem[handle]);
+        if (blk_flush_leader != handle) {
+            return blk_flush_result[handle];
+        }
+    }
+    blk_flush_busy = true;
+    blk_flush_waiters = blk_flush_queued & ~(1 << handle);
+    blk_flush_queued = 0;
+    blk_flush_leader = 0;
+    blk_flush_sent = false;
+
+    LOG_FATFS("blk_enqueue_syncreq\n");
+    enqueue_req(blk_queue_handle, &blk_request_pushed, BLK_REQ_FLUSH, 0, 0, 0);
+    wait_for_blk_resp();
+    DRESULT res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
+
+    for (uint32_t i = 1; i <= FAT_WORKER_THREAD_NUM; i++) {
+        if (blk_flush_waiters & (1 << i)) {
+            blk_flush_result[i] = res;
+            microkit_cothread_semaphore_signal(&sem[i]);
+        }
+    }
+    blk_flush_waiters = 0;
+
+    if (blk_flush_queued) {
+        blk_flush_leader = __builtin_ctz(blk_flush_queued);
+        microkit_cothread_semaphore_signal(&sem[blk_flush_leader]);
+    } else {
+        blk_flush_busy = false;
+    }
+    return res;
+}
+
+// The sectors [first, last] are no longer used by the file system
+static DRESULT disk_trim(LBA_t first, LBA_t last) {
+    /*
+     * FatFs reports freed clusters some time after freeing them, and they may have been allocated to
+     * another file and written by another thread in the meantime. Only clusters that the free cluster
+     * map says are still free are trimmed.
+     */
+    if (!fat_freemap_sectors_free(first, last)) {
+        return RES_OK;
+    }
+    uint16_t sector_per_transfer = DIV_POWER_OF_2(BLK_TRANSFER_SIZE, blk_config->sector_size);
+    // Only transfer blocks lying entirely within the range can be dropped
+    uint64_t first_block = DIV_POWER_OF_2(first + sector_per_transfer - 1, sector_per_transfer);
+    uint64_t end_block = DIV_POWER_OF_2(last + 1, sector_per_transfer);
+    if (end_block <= first_block) {
+        return RES_OK;
+    }
+    LOG_FATFS("disk_trim: block: %lu count: %lu\n", first_block, end_block - first_block);
+    // Nothing will read what is cached for these blocks, and dirty ones need not be written back
+    for (uint64_t block = first_block; block < end_block; block++) {
+        fat_cache_discard(block);
+    }
+    return RES_OK;
+}
+
 DSTATUS disk_initialize (
     BYTE pdrv                /* Physical drive number to identify the drive */
 )
 {
-    // thread_blk_addr[0] is not initialized as that is the slot for event thread
+    fat_cache_init();
+
+#ifdef FAT_READAHEAD
     for (uint16_t i = 0; i < FAT_WORKER_THREAD_NUM; i++) {
-        thread_blk_addr[i] = i * MAX_CLUSTER_SIZE;
+        thread_last_block[i] = NO_BLOCK;
     }
+#endif
 
     // Check whether the block device is ready or not
     if (!blk_config->ready) {
@@ -100,26 +693,84 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff) {
     }
     if (cmd == CTRL_SYNC) {
         res = RES_OK;
-        LOG_FATFS("blk_enqueue_syncreq\n");
-        int err = blk_enqueue_req(blk_queue_handle, BLK_REQ_FLUSH, 0, 0, 0, microkit_cothread_my_handle());
-        assert(!err);
-        blk_request_pushed = true;
-        wait_for_blk_resp();
-        res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
+#ifdef FAT_CACHE_WRITE_BACK
+        // A flush skips lines another thread is writing, and waits for them once it has nothing
+        // else to write. The device flush has to come after those writes as well.
+        while (fat_cache_dirty_count() > 0) {
+            res = fat_cache_flush();
+            if (res != RES_OK) {
+                return res;
+            }
+        }
+#endif
+        res = disk_flush();
+    }
+    if (cmd == CTRL_TRIM) {
+        LBA_t *range = buff;
+        res = disk_trim(range[0], range[1]);
     }
     return res;
 }
 
-#define MOD_POWER_OF_2(a, b) ((a) & ((b) - 1))
-#define DIV_POWER_OF_2(a, b) ((a) >> (__builtin_ctz(b)))
-#define MUL_POWER_OF_2(a, b) ((a) << (__builtin_ctz(b)))
+/*
+ * Copy sectors [sector, sector + count) into buff from the transfer blocks starting at first_block.
+ * A block is taken from the cache when present, otherwise from region, which holds the blocks as
+ * read from the device. The cached copy is never older than the one on the device.
+ */
+static void copy_out_sectors(BYTE *buff, LBA_t sector, UINT count, uint32_t first_block, int32_t block_count, const char *region) {
+    uint16_t sector_size = blk_config->sector_size;
+    uint16_t sector_per_transfer = DIV_POWER_OF_2(BLK_TRANSFER_SIZE, sector_size);
+    for (int32_t i = 0; i < block_count; i++) {
+        LBA_t block_start = MUL_POWER_OF_2((LBA_t)(first_block + i), sector_per_transfer);
+        LBA_t start = MAX(sector, block_start);
+        LBA_t end = MIN(sector + count, block_start + sector_per_transfer);
+        const char *src = fat_cache_peek(first_block + i);
+        if (src == NULL) {
+            src = region + MUL_POWER_OF_2(i, BLK_TRANSFER_SIZE);
+        }
+        memcpy(buff + (start - sector) * sector_size, src + (start - block_start) * sector_size, (end - start) * sector_size);
+    }
+}
+
+#ifdef FAT_ZERO_COPY
+/*
+ * Read whole transfer blocks straight into the client data region over the zero copy blk connection,
+ * whose data region is the client data region. Blocks dirty in the cache are newer than what is on
+ * the device, so they are copied over what was read.
+ */
+static DRESULT disk_read_zero_copy(BYTE *buff, uint64_t client_offset, uint32_t first_block, int32_t block_count) {
+    LOG_FATFS("blk_enqueue_read zero copy: offset: 0x%lx sector: %u, count: %d\n", client_offset, first_block, block_count);
+    // No space in the blk data region is needed, so the only limit is the number of requests in flight
+    int32_t done = 0;
+    while (done < block_count) {
+        for (uint32_t i = 0; i < FAT_BLK_REQUESTS_PER_THREAD && done < block_count; i++) {
+            int32_t count = MIN(block_count - done, FAT_BLK_MAX_REQUEST_BLOCKS);
+            enqueue_req(blk_zero_copy_queue_handle, &blk_zero_copy_request_pushed, BLK_REQ_READ,
+                        client_offset + MUL_POWER_OF_2((uint64_t)done, BLK_TRANSFER_SIZE), first_block + done, count);
+            done += count;
+        }
+        wait_for_blk_resp();
+
+        DRESULT res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+
+    for (int32_t i = 0; i < block_count; i++) {
+        uint64_t seq;
+        char *line = fat_cache_dirty_line(first_block + i, &seq);
+        if (line != NULL) {
+            memcpy(buff + MUL_POWER_OF_2(i, BLK_TRANSFER_SIZE), line, BLK_TRANSFER_SIZE);
+        }
+    }
+    return RES_OK;
+}
+#endif
 
 DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
     DRESULT res;
     int handle = microkit_cothread_my_handle();
-    // Accroding the protocol, all the read/write addr passed to the blk_virt should be page aligned
-    // Substract the handle with one as the worker thread ID starts at 1, not 0
-    uint64_t read_data_offset = thread_blk_addr[handle - 1];
     uint16_t sector_size = blk_config->sector_size;
     // This is the same as BLK_TRANSFER_SIZE / sector_size
     uint16_t sector_per_transfer = DIV_POWER_OF_2(BLK_TRANSFER_SIZE, sector_size);
@@ -138,79 +789,361 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
     int32_t aligned_sector = count - unaligned_head_sector - unaligned_tail_sector;
     sddf_count += DIV_POWER_OF_2(aligned_sector, sector_per_transfer);
 
-    assert(MUL_POWER_OF_2(sddf_count, BLK_TRANSFER_SIZE) <= MAX_CLUSTER_SIZE);
+    bool cached;
+    while (true) {
+        cached = true;
+        for (int32_t i = 0; i < sddf_count; i++) {
+            if (fat_cache_lookup(sddf_sector + i) == NULL) {
+                cached = false;
+            }
+        }
+#ifdef FAT_READAHEAD
+        // A read-ahead already on its way will complete sooner than a new request
+        if (!cached && readahead_wait(sddf_sector, sddf_count)) {
+            continue;
+        }
+        thread_last_block[handle - 1] = sddf_sector + sddf_count - 1;
+#endif
+        break;
+    }
+    if (cached) {
+        copy_out_sectors(buff, sector, count, sddf_sector, sddf_count, NULL);
+        return RES_OK;
+    }
+
+#ifdef FAT_ZERO_COPY
+    // FatFs passes the client's buffer through for reads of whole sectors into it
+    uint64_t client_offset = (char *)buff - client_data_addr;
+    if ((char *)buff >= client_data_addr && client_offset + count * sector_size <= FAT_FS_DATA_REGION_SIZE
+        && MOD_POWER_OF_2(client_offset, BLK_TRANSFER_SIZE) == 0 && MOD_POWER_OF_2(sector, sector_per_transfer) == 0
+        && MOD_POWER_OF_2(count, sector_per_transfer) == 0 && sddf_count >= FAT_ZERO_COPY_MIN_BLOCKS) {
+        return disk_read_zero_copy(buff, client_offset, sddf_sector, sddf_count);
+    }
+#endif
 
-    LOG_FATFS("blk_enqueue_read pre adjust: addr: 0x%lx sector: %u, count: %u ID: %d\n", read_data_offset, sector, count, handle);
-    LOG_FATFS("blk_enqueue_read after adjust: addr: 0x%lx sector: %u, count: %d ID: %d\n", read_data_offset, sddf_sector, sddf_count, handle);
+    LOG_FATFS("blk_enqueue_read pre adjust: sector: %u, count: %u ID: %d\n", sector, count, handle);
+    LOG_FATFS("blk_enqueue_read after adjust: sector: %u, count: %d ID: %d\n", sddf_sector, sddf_count, handle);
 
-    int err = blk_enqueue_req(blk_queue_handle, BLK_REQ_READ, read_data_offset, sddf_sector, sddf_count, handle);
-    assert(!err);
+    demand_read_t *rd = &demand_reads[handle - 1];
+    rd->block = sddf_sector;
+    rd->count = sddf_count;
+    rd->stale = false;
 
-    blk_request_pushed = true;
-    wait_for_blk_resp();
+    uint32_t done = 0;
+    while (done < (uint32_t)sddf_count) {
+        blk_chunk_t chunks[FAT_BLK_REQUESTS_PER_THREAD];
+        uint32_t n = alloc_chunks(done, sddf_count - done, chunks);
+        for (uint32_t i = 0; i < n; i++) {
+            enqueue_req(blk_queue_handle, &blk_request_pushed, BLK_REQ_READ,
+                        MUL_POWER_OF_2((uint64_t)chunks[i].region_block, BLK_TRANSFER_SIZE),
+                        sddf_sector + chunks[i].index, chunks[i].count);
+        }
+        wait_for_blk_resp();
+        res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
 
-    res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
-    memcpy(buff, blk_data_region + read_data_offset + sector_size * MOD_POWER_OF_2(sector, sector_per_transfer), sector_size * count);
-    return res;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t first_block = sddf_sector + chunks[i].index;
+            char *region = region_addr(chunks[i].region_block);
+            if (res == RES_OK) {
+                copy_out_sectors(buff, sector, count, first_block, chunks[i].count, region);
+                if (sddf_count <= FAT_CACHE_BYPASS_BLOCKS && !rd->stale) {
+                    for (uint32_t j = 0; j < chunks[i].count; j++) {
+                        if (fat_cache_peek(first_block + j) == NULL) {
+                            fat_cache_insert(first_block + j, region + MUL_POWER_OF_2(j, BLK_TRANSFER_SIZE));
+                        }
+                    }
+                }
+            }
+            region_free(chunks[i].region_block, chunks[i].count);
+            done += chunks[i].count;
+        }
+        if (res != RES_OK) {
+            rd->count = 0;
+            return res;
+        }
+    }
+    rd->count = 0;
+    return RES_OK;
 }
 
-DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
-    DRESULT res;
-    int handle = microkit_cothread_my_handle();
-    // Substract the handle with one as the worker thread ID starts at 1, not 0
-    uint64_t write_data_offset = thread_blk_addr[handle - 1];
-    uint16_t sector_size = blk_config->sector_size;
-    if (sector_size == BLK_TRANSFER_SIZE) {
-        assert(MUL_POWER_OF_2(count, BLK_TRANSFER_SIZE) <= MAX_CLUSTER_SIZE);
+/*
+ * Write through to the cache, only refreshing blocks already cached when the write is large.
+ * The blocks are now the same as on the device, so any of them that were dirty become clean.
+ * seqs holds the sequence number of each block when its data was put together for the write, or 0
+ * if it was not cached. A line that has changed since was written to by another thread while this
+ * write was in flight and holds data the device has not seen, so only the sectors written here are
+ * copied into it and it is left dirty.
+ */
+static void update_cache(const char *region, uint32_t first_block, uint32_t block_count, const uint64_t *seqs,
+                         LBA_t sector, UINT count, bool large) {
+    for (uint32_t i = 0; i < block_count; i++) {
+        uint32_t block = first_block + i;
+        const char *data = region + MUL_POWER_OF_2(i, BLK_TRANSFER_SIZE);
+        char *line = fat_cache_peek(block);
+#ifdef FAT_CACHE_WRITE_BACK
+        if (line != NULL && fat_cache_seq(block) != seqs[i]) {
+            uint16_t sector_size = blk_config->sector_size;
+            uint16_t sector_per_transfer = DIV_POWER_OF_2(BLK_TRANSFER_SIZE, sector_size);
+            LBA_t block_start = MUL_POWER_OF_2((LBA_t)block, sector_per_transfer);
+            LBA_t start = MAX(sector, block_start);
+            LBA_t end = MIN(sector + count, block_start + sector_per_transfer);
+            uint32_t offset = (start - block_start) * sector_size;
+            memcpy(line + offset, data + offset, (end - start) * sector_size);
+            fat_cache_mark_dirty(block);
+            continue;
+        }
+#endif
+        if (!large || line != NULL) {
+            fat_cache_insert(block, data);
+        }
+        uint64_t seq;
+        if (fat_cache_dirty_line(block, &seq) != NULL) {
+            fat_cache_mark_clean(block, seq);
+        }
+    }
+}
 
-        memcpy(blk_data_region + write_data_offset, buff, sector_size * count);
-        int err = blk_enqueue_req(blk_queue_handle, BLK_REQ_WRITE, write_data_offset, sector, count,handle);
-        assert(!err);
+#ifdef FAT_CACHE_WRITE_BACK
+/*
+ * Write every dirty block in the cache back to the device. Dirty blocks are written in ascending
+ * order and runs of consecutive blocks are merged into a single request, as large as the free space
+ * in the blk data region allows.
+ */
+static DRESULT fat_cache_flush(void) {
+    uint64_t blocks[FAT_CACHE_LINES];
+    uint64_t seqs[FAT_CACHE_LINES];
+    uint64_t n = fat_cache_collect_dirty(blocks, FAT_CACHE_LINES);
+    if (n == 0 && fat_cache_dirty_count() > 0) {
+        // Every dirty line is being written by another thread, wait for one of those writes so a
+        // caller looking for a clean line does not spin
+        line_write_wait();
+        return RES_OK;
     }
-    else {
-        uint16_t sector_per_transfer = DIV_POWER_OF_2(BLK_TRANSFER_SIZE, sector_size);
-        uint32_t sddf_sector = DIV_POWER_OF_2(sector, sector_per_transfer);
-        int32_t sddf_count = 0;
-        uint32_t unaligned_head_sector = MOD_POWER_OF_2(sector_per_transfer - MOD_POWER_OF_2(sector, sector_per_transfer), sector_per_transfer);
-        uint32_t unaligned_tail_sector = MOD_POWER_OF_2(sector + count, sector_per_transfer);
-        if (unaligned_head_sector) {
-            sddf_count += 1;
-        }
-        if (unaligned_tail_sector) {
-            sddf_count += 1;
+
+    DRESULT res = RES_OK;
+    uint64_t i = 0;
+    while (i < n) {
+        // Find the run of dirty blocks starting here
+        uint32_t run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run) {
+            run++;
         }
 
-        int32_t aligned_sector = count - unaligned_head_sector - unaligned_tail_sector;
-        sddf_count += DIV_POWER_OF_2(aligned_sector, sector_per_transfer);
+        uint32_t first;
+        run = region_alloc_wait(run, &first);
+        char *region = region_addr(first);
 
-        assert(MUL_POWER_OF_2(sddf_count, BLK_TRANSFER_SIZE) <= MAX_CLUSTER_SIZE);
+        // Lines may have been written back by another thread while this one was waiting
+        uint32_t count = 0;
+        while (count < run) {
+            char *line = fat_cache_dirty_line(blocks[i + count], &seqs[i + count]);
+            if (line == NULL) {
+                break;
+            }
+            memcpy(region + MUL_POWER_OF_2(count, BLK_TRANSFER_SIZE), line, BLK_TRANSFER_SIZE);
+            fat_cache_write_start(blocks[i + count]);
+            count++;
+        }
+        if (count == 0) {
+            region_free(first, run);
+            i++;
+            continue;
+        }
 
-        LOG_FATFS("blk_enqueue_write pre adjust: addr: 0x%lx sector: %u, count: %u ID: %d buffer_addr_in_fs: 0x%p\n", write_data_offset, sector, count, handle, buff);
-        LOG_FATFS("blk_enqueue_write after adjust: addr: 0x%lx sector: %u, count: %d ID: %d\n", write_data_offset, sddf_sector, sddf_count, handle);
+        LOG_FATFS("fat_cache_flush: block: %lu, count: %u\n", blocks[i], count);
+        blocks_written(blocks[i], count);
+        enqueue_req(blk_queue_handle, &blk_request_pushed, BLK_REQ_WRITE, MUL_POWER_OF_2((uint64_t)first, BLK_TRANSFER_SIZE),
+                    blocks[i], count);
+        wait_for_blk_resp();
+        DRESULT run_res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
+        region_free(first, run);
+        for (uint32_t j = 0; j < count; j++) {
+            if (run_res == RES_OK) {
+                fat_cache_mark_clean(blocks[i + j], seqs[i + j]);
+            }
+            fat_cache_write_done(blocks[i + j]);
+        }
+        line_writes_done();
+        if (run_res != RES_OK) {
+            res = run_res;
+        }
+        i += count;
+    }
+    return res;
+}
 
-        // When there is no unaligned sector, we do not need to send a read request
-        if (unaligned_head_sector == 0 && unaligned_tail_sector == 0) {
-            memcpy(blk_data_region + write_data_offset, buff, sector_size * count);
-            int err = blk_enqueue_req(blk_queue_handle, BLK_REQ_WRITE, write_data_offset, sddf_sector, sddf_count,handle);
-            assert(!err);
+// Job run on a worker thread when the flush timer fires
+void fat_cache_flush_job(void) {
+    co_data_t *args = microkit_cothread_my_arg();
+    args->status = (fat_cache_flush() == RES_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
+}
+
+// Get a cache line to hold block, writing back dirty blocks if there is no room for it
+static char *cache_line_for_write(uint64_t block, const char *data) {
+    for (;;) {
+        char *line = fat_cache_peek(block);
+        if (line != NULL) {
+            return line;
         }
-        else {
-            int err = blk_enqueue_req(blk_queue_handle, BLK_REQ_READ, write_data_offset, sddf_sector, sddf_count,handle);
-            assert(!err);
-            blk_request_pushed = true;
-            wait_for_blk_resp();
-            res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
-            // If the disk operation is not successful, stop here.
+        line = fat_cache_insert(block, data);
+        if (line != NULL) {
+            return line;
+        }
+        if (fat_cache_flush() != RES_OK) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Write back mode: the sectors are copied into the cache and the blocks marked dirty, the device
+ * only sees them when the cache is flushed. A partially written block that is not cached is read
+ * first, so unlike the write through path only the blocks at the edges of the write are read.
+ */
+static DRESULT disk_write_back(const BYTE *buff, LBA_t sector, UINT count) {
+    uint16_t sector_size = blk_config->sector_size;
+    uint16_t sector_per_transfer = DIV_POWER_OF_2(BLK_TRANSFER_SIZE, sector_size);
+    uint32_t first_block = DIV_POWER_OF_2(sector, sector_per_transfer);
+    uint32_t last_block = DIV_POWER_OF_2(sector + count - 1, sector_per_transfer);
+
+    for (uint32_t block = first_block; block <= last_block; block++) {
+        LBA_t block_start = MUL_POWER_OF_2((LBA_t)block, sector_per_transfer);
+        LBA_t start = MAX(sector, block_start);
+        LBA_t end = MIN(sector + count, block_start + sector_per_transfer);
+        const BYTE *src = buff + (start - sector) * sector_size;
+
+        char *line;
+        if (end - start == sector_per_transfer) {
+            line = cache_line_for_write(block, (const char *)src);
+        } else if ((line = fat_cache_peek(block)) == NULL) {
+            char old[BLK_TRANSFER_SIZE];
+            DRESULT res = read_block(block, old);
             if (res != RES_OK) {
                 return res;
             }
-            memcpy(blk_data_region + write_data_offset + sector_size * MOD_POWER_OF_2(sector, sector_per_transfer), buff, sector_size * count);
-            err = blk_enqueue_req(blk_queue_handle, BLK_REQ_WRITE, write_data_offset, sddf_sector, sddf_count,handle);
-            assert(!err);
+            line = cache_line_for_write(block, old);
         }
+        if (line == NULL) {
+            return RES_ERROR;
+        }
+        memcpy(line + (start - block_start) * sector_size, src, (end - start) * sector_size);
+        fat_cache_mark_dirty(block);
     }
-    blk_request_pushed = true;
-    wait_for_blk_resp();
-    res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
-    return res;
+
+    if (fat_cache_dirty_count() > FAT_CACHE_DIRTY_HIGH) {
+        return fat_cache_flush();
+    }
+    return RES_OK;
+}
+#endif
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
+    DRESULT res;
+    uint16_t sector_size = blk_config->sector_size;
+    uint16_t sector_per_transfer = DIV_POWER_OF_2(BLK_TRANSFER_SIZE, sector_size);
+    uint32_t sddf_sector = DIV_POWER_OF_2(sector, sector_per_transfer);
+    uint32_t sddf_count = DIV_POWER_OF_2(sector + count - 1, sector_per_transfer) - sddf_sector + 1;
+    blocks_written(sddf_sector, sddf_count);
+#ifdef FAT_CACHE_WRITE_BACK
+    // Large writes go straight to the device rather than pushing everything else out of the cache
+    if (DIV_POWER_OF_2(sector_size * count, BLK_TRANSFER_SIZE) <= FAT_CACHE_BYPASS_BLOCKS) {
+        return disk_write_back(buff, sector, count);
+    }
+#endif
+
+    LOG_FATFS("blk_enqueue_write pre adjust: sector: %u, count: %u buffer_addr_in_fs: 0x%p\n", sector, count, buff);
+    LOG_FATFS("blk_enqueue_write after adjust: sector: %u, count: %d\n", sddf_sector, sddf_count);
+
+    // The blocks at either end of the write may only be partially written, the rest of them has to
+    // be read first. The cached copy of a block is never older than the one on the device, if the
+    // block is still cached when the write is sent that copy is used instead.
+    char edge[2][BLK_TRANSFER_SIZE];
+    uint64_t edge_seq[2] = { 0, 0 };
+    uint32_t edge_block[2] = { sddf_sector, sddf_sector + sddf_count - 1 };
+    bool edge_partial[2] = {
+        MOD_POWER_OF_2(sector, sector_per_transfer) != 0,
+        MOD_POWER_OF_2(sector + count, sector_per_transfer) != 0,
+    };
+    for (int e = 0; e < 2; e++) {
+        // A write within a single block only needs it read once
+        if (!edge_partial[e] || (e == 1 && edge_partial[0] && sddf_count == 1)) {
+            continue;
+        }
+        // Taken before anything that can block, for update_cache to notice later changes
+        edge_seq[e] = fat_cache_seq(edge_block[e]);
+        char *line = fat_cache_peek(edge_block[e]);
+        if (line != NULL) {
+            memcpy(edge[e], line, BLK_TRANSFER_SIZE);
+        } else if ((res = read_block(edge_block[e], edge[e])) != RES_OK) {
+            return res;
+        }
+    }
+
+    uint32_t done = 0;
+    while (done < sddf_count) {
+        blk_chunk_t chunks[FAT_BLK_REQUESTS_PER_THREAD];
+        uint64_t seqs[FAT_BLK_REQUESTS_PER_THREAD][FAT_BLK_MAX_REQUEST_BLOCKS];
+        uint32_t n = alloc_chunks(done, sddf_count - done, chunks);
+        uint32_t round_count = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            round_count += chunks[i].count;
+        }
+        // A write back of any of these blocks already in flight could complete after this write,
+        // wait for it. Nothing below blocks until the requests are queued, and the cached blocks are
+        // marked as being written so they are not written back in the meantime either.
+        while (blocks_writing(sddf_sector + done, round_count)) {
+            line_write_wait();
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            char *region = region_addr(chunks[i].region_block);
+            for (uint32_t j = 0; j < chunks[i].count; j++) {
+                uint32_t block = sddf_sector + chunks[i].index + j;
+                char *dst = region + MUL_POWER_OF_2(j, BLK_TRANSFER_SIZE);
+                LBA_t block_start = MUL_POWER_OF_2((LBA_t)block, sector_per_transfer);
+                LBA_t start = MAX(sector, block_start);
+                LBA_t end = MIN(sector + count, block_start + sector_per_transfer);
+                char *line = fat_cache_peek(block);
+                int e = (block == edge_block[0] && edge_partial[0]) ? 0
+                        : (block == edge_block[1] && edge_partial[1]) ? 1 : -1;
+                if (line != NULL) {
+                    seqs[i][j] = fat_cache_seq(block);
+                    fat_cache_write_start(block);
+                    if (e >= 0) {
+                        memcpy(dst, line, BLK_TRANSFER_SIZE);
+                    }
+                } else if (e >= 0) {
+                    memcpy(dst, edge[e], BLK_TRANSFER_SIZE);
+                    seqs[i][j] = edge_seq[e];
+                } else {
+                    seqs[i][j] = 0;
+                }
+                memcpy(dst + (start - block_start) * sector_size, buff + (start - sector) * sector_size, (end - start) * sector_size);
+            }
+            enqueue_req(blk_queue_handle, &blk_request_pushed, BLK_REQ_WRITE,
+                        MUL_POWER_OF_2((uint64_t)chunks[i].region_block, BLK_TRANSFER_SIZE),
+                        sddf_sector + chunks[i].index, chunks[i].count);
+        }
+        wait_for_blk_resp();
+        res = (DRESULT)(uintptr_t)microkit_cothread_my_arg();
+
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t first_block = sddf_sector + chunks[i].index;
+            if (res == RES_OK) {
+                // The region now holds every transfer block touched by the write
+                update_cache(region_addr(chunks[i].region_block), first_block, chunks[i].count,
+                             seqs[i], sector, count, sddf_count > FAT_CACHE_BYPASS_BLOCKS);
+            }
+            // A dirty block the write failed on stays dirty and is written back later
+            for (uint32_t j = 0; j < chunks[i].count; j++) {
+                fat_cache_write_done(first_block + j);
+            }
+            region_free(chunks[i].region_block, chunks[i].count);
+            done += chunks[i].count;
+        }
+        line_writes_done();
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+    return RES_OK;
 }
@@ -5,12 +5,15 @@
 
 #include "decl.h"
 #include "ff.h"
+#include "diskio.h"
+#include "cache.h"
 #include <libmicrokitco.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <lions/fs/protocol.h>
 #include <fat_config.h>
+#include <sddf/util/util.h>
 
 /*
 This file define a bunch of wrapper functions of FATFs functions so those functions can be run in the
@@ -30,9 +33,252 @@ FIL* files;
 descriptor_status* dir_status;
 DIR* dirs;
 
+#ifdef FAT_READAHEAD
+// Per file sequential access detection, a read starting where the previous one ended is sequential
+typedef struct readahead_state {
+    uint64_t next_offset;
+    uint32_t window;
+} readahead_state_t;
+
+static readahead_state_t file_readahead[FAT_MAX_OPENED_FILENUM];
+
+// Grow the read-ahead window on sequential access and drop it on random access
+static uint32_t readahead_window(uint64_t fd, uint64_t offset) {
+    readahead_state_t *ra = &file_readahead[fd];
+    if (offset != ra->next_offset) {
+        ra->window = 0;
+    } else if (ra->window == 0) {
+        ra->window = FAT_READAHEAD_MIN_BLOCKS;
+    } else {
+        ra->window = MIN(ra->window * 2, FAT_READAHEAD_MAX_BLOCKS);
+    }
+    fat_readahead_reset();
+    return ra->window;
+}
+
+static void readahead_done(uint64_t fd, uint64_t offset, uint64_t len, uint32_t window) {
+    file_readahead[fd].next_offset = offset + len;
+    if (window != 0 && len != 0) {
+        fat_readahead(window);
+    }
+}
+#endif
+
+#if FF_USE_FASTSEEK
+// Cluster link map tables let f_lseek find the cluster holding any offset without walking the FAT chain.
+// A table is built the first time a file is accessed out of order and is dropped whenever the file grows
+// or shrinks, as FatFs cannot allocate clusters to a file in fast seek mode.
+typedef enum : uint8_t {
+    CLMT_NONE = 0,
+    CLMT_BUILDING = 1,
+    CLMT_READY = 2,
+    CLMT_NO_SPACE = 3,
+} clmt_status;
+
+typedef struct clmt_state {
+    clmt_status status;
+    uint32_t offset;
+    uint32_t size;
+} clmt_state_t;
+
+static DWORD *clmt_arena;
+static clmt_state_t file_clmt[FAT_MAX_OPENED_FILENUM];
+
+// First fit allocation of size words in the arena, skipping over the tables of the other files
+static bool clmt_alloc(uint32_t size, uint32_t *offset) {
+    if (size > FAT_CLMT_ARENA_WORDS) {
+        return false;
+    }
+    uint32_t start = 0;
+    bool moved = true;
+    while (moved) {
+        moved = false;
+        for (uint32_t i = 0; i < FAT_MAX_OPENED_FILENUM; i++) {
+            clmt_state_t *clmt = &file_clmt[i];
+            if (clmt->size != 0 && start < clmt->offset + clmt->size && clmt->offset < start + size) {
+                start = clmt->offset + clmt->size;
+                moved = true;
+            }
+        }
+    }
+    if (start + size > FAT_CLMT_ARENA_WORDS) {
+        return false;
+    }
+    *offset = start;
+    return true;
+}
+
+static void clmt_drop(uint64_t fd) {
+    files[fd].cltbl = NULL;
+    file_clmt[fd].status = CLMT_NONE;
+    file_clmt[fd].size = 0;
+}
+
+// Build the table of a file before seeking away from the current position. Small tables are built in a
+// buffer on the stack and copied into the arena, larger ones need a second walk once the size is known.
+// The walk is done through the caller's FIL, which is a private copy for readers, and the table is only
+// published once complete. Tables are dropped with the file locked exclusively, so none can go away here.
+static void clmt_build(uint64_t fd, FIL *file, uint64_t offset) {
+    clmt_state_t *clmt = &file_clmt[fd];
+    if (clmt->status != CLMT_NONE || offset == file->fptr
+        || f_size(file) <= (FSIZE_t)file->obj.fs->csize * file->obj.fs->ssize) {
+        return;
+    }
+
+    DWORD probe[FAT_CLMT_PROBE_WORDS];
+    probe[0] = FAT_CLMT_PROBE_WORDS;
+    clmt->status = CLMT_BUILDING;
+    file->cltbl = probe;
+    FRESULT RET = f_lseek(file, CREATE_LINKMAP);
+    file->cltbl = NULL;
+    if (RET != FR_OK && RET != FR_NOT_ENOUGH_CORE) {
+        clmt->status = CLMT_NONE;
+        return;
+    }
+
+    uint32_t size = probe[0];
+    if (!clmt_alloc(size, &clmt->offset)) {
+        LOG_FATFS("clmt_build: no space for a table of %u words\n", size);
+        clmt->status = CLMT_NO_SPACE;
+        return;
+    }
+    clmt->size = size;
+    DWORD *table = clmt_arena + clmt->offset;
+
+    if (RET == FR_OK) {
+        memcpy(table, probe, size * sizeof(DWORD));
+    } else {
+        table[0] = size;
+        file->cltbl = table;
+        RET = f_lseek(file, CREATE_LINKMAP);
+        file->cltbl = NULL;
+        if (RET != FR_OK) {
+            clmt->status = CLMT_NONE;
+            clmt->size = 0;
+            return;
+        }
+    }
+
+    file->cltbl = table;
+    files[fd].cltbl = table;
+    clmt->status = CLMT_READY;
+}
+#endif
+
+#ifdef FAT_DIRECT_IO
+// A file is contiguous if exFAT says it has no FAT chain, or if its cluster link map has a single fragment
+static bool file_contiguous(uint64_t fd, FIL *file) {
+    if (file->obj.sclust == 0) {
+        return false;
+    }
+#if FF_FS_EXFAT
+    if (file->obj.fs->fs_type == FS_EXFAT && file->obj.stat == 2) {
+        return true;
+    }
+#endif
+#if FF_USE_FASTSEEK
+    if (file_clmt[fd].status == CLMT_READY && clmt_arena[file_clmt[fd].offset] == 4) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Large transfers on a contiguous file bypass FatFs, which works through a file one cluster at a time.
+// Only the whole sectors in the middle of the range go straight to the disk, as a single run, the
+// partial sectors at either end are left to FatFs. The range must lie within the file.
+static bool direct_range(uint64_t fd, FIL *file, uint64_t offset, uint64_t len, uint64_t *head, uint64_t *size) {
+    uint64_t ssize = file->obj.fs->ssize;
+    if (len < FAT_DIRECT_IO_MIN_SIZE || offset + len > f_size(file) || !file_contiguous(fd, file)) {
+        return false;
+    }
+    uint64_t start = (offset + ssize - 1) / ssize * ssize;
+    uint64_t end = (offset + len) / ssize * ssize;
+    if (end <= start) {
+        return false;
+    }
+    *head = start - offset;
+    *size = end - start;
+    return true;
+}
+
+static LBA_t file_sector(FIL *file, uint64_t offset) {
+    FATFS *fs = file->obj.fs;
+    return fs->database + (LBA_t)fs->csize * (file->obj.sclust - 2) + offset / fs->ssize;
+}
+
+// Read [offset, offset + len) of a contiguous file, the file position must be at offset
+static FRESULT direct_read(FIL *file, char *data, uint64_t offset, uint64_t len, uint64_t head, uint64_t size,
+                           uint32_t *br) {
+    FATFS *fs = file->obj.fs;
+    uint32_t n = 0;
+    *br = 0;
+    FRESULT RET = f_read(file, data, head, &n);
+    *br += n;
+    if (RET != FR_OK || n < head) {
+        return RET;
+    }
+
+    LBA_t sector = file_sector(file, offset + head);
+    UINT count = size / fs->ssize;
+    if (disk_read(fs->pdrv, (BYTE *)data + head, sector, count) != RES_OK) {
+        return FR_DISK_ERR;
+    }
+    // The file's sector buffer may hold data not yet written to the disk
+    if ((file->flag & FA_DIRTY) && file->sect >= sector && file->sect < sector + count) {
+        memcpy(data + head + (file->sect - sector) * fs->ssize, file->buf, fs->ssize);
+    }
+    *br += size;
+
+    RET = f_lseek(file, offset + head + size);
+    if (RET != FR_OK) {
+        return RET;
+    }
+    RET = f_read(file, data + head + size, len - head - size, &n);
+    *br += n;
+    return RET;
+}
+
+// Write [offset, offset + len) of a contiguous file, the file position must be at offset
+static FRESULT direct_write(FIL *file, const char *data, uint64_t offset, uint64_t len, uint64_t head, uint64_t size,
+                            uint32_t *bw) {
+    FATFS *fs = file->obj.fs;
+    uint32_t n = 0;
+    *bw = 0;
+    FRESULT RET = f_write(file, data, head, &n);
+    *bw += n;
+    if (RET != FR_OK || n < head) {
+        return RET;
+    }
+
+    LBA_t sector = file_sector(file, offset + head);
+    UINT count = size / fs->ssize;
+    // The sector buffer is overwritten by this write if it falls in the range, so drop it
+    if (file->sect >= sector && file->sect < sector + count) {
+        file->flag &= (BYTE)~FA_DIRTY;
+        file->sect = 0;
+    }
+    if (disk_write(fs->pdrv, (const BYTE *)data + head, sector, count) != RES_OK) {
+        return FR_DISK_ERR;
+    }
+    file->flag |= FA_MODIFIED;
+    *bw += size;
+
+    RET = f_lseek(file, offset + head + size);
+    if (RET != FR_OK) {
+        return RET;
+    }
+    RET = f_write(file, data + head + size, len - head - size, &n);
+    *bw += n;
+    return RET;
+}
+#endif
+
 // Data buffer offset
 extern char *client_data_addr;
 
+extern microkit_cothread_sem_t sem[FAT_WORKER_THREAD_NUM + 1];
+
 // Sanity check functions
 // Checking if the memory region that provided by request is within valid memory region
 static inline FRESULT within_data_region(uint64_t offset, uint64_t buffer_size) {
@@ -51,6 +297,71 @@ static inline FRESULT validate_file_descriptor(uint64_t fd) {
     return FR_INVALID_PARAMETER;
 }
 
+// Positional reads work on a private copy of the FIL, so any number of them can run on one file at
+// once as long as nothing changes the shared FIL underneath them. Operations that do take the lock
+// exclusively. A waiting writer holds off new readers so that it is not starved.
+typedef struct file_lock {
+    uint32_t readers;
+    uint32_t writers_waiting;
+    bool writer;
+    uint32_t waiters;
+} file_lock_t;
+
+static file_lock_t file_locks[FAT_MAX_OPENED_FILENUM];
+
+static void file_lock_wait(file_lock_t *lock) {
+    lock->waiters |= 1 << microkit_cothread_my_handle();
+    microkit_cothread_semaphore_wait(&sem[microkit_cothread_my_handle()]);
+}
+
+static void file_lock_wake(file_lock_t *lock) {
+    for (uint32_t handle = 1; handle <= FAT_WORKER_THREAD_NUM; handle++) {
+        if (lock->waiters & (1 << handle)) {
+            microkit_cothread_semaphore_signal(&sem[handle]);
+        }
+    }
+    lock->waiters = 0;
+}
+
+static void file_release(uint64_t fd, bool exclusive) {
+    file_lock_t *lock = &file_locks[fd];
+    if (exclusive) {
+        lock->writer = false;
+    } else {
+        lock->readers--;
+    }
+    if (lock->readers == 0) {
+        file_lock_wake(lock);
+    }
+}
+
+// Validate the descriptor and lock the file. The descriptor is checked again once the lock is
+// held, as the file may have been closed while we were waiting.
+static FRESULT file_acquire(uint64_t fd, bool exclusive) {
+    if (validate_file_descriptor(fd) != FR_OK) {
+        return FR_INVALID_PARAMETER;
+    }
+    file_lock_t *lock = &file_locks[fd];
+    if (exclusive) {
+        lock->writers_waiting++;
+        while (lock->writer || lock->readers != 0) {
+            file_lock_wait(lock);
+        }
+        lock->writers_waiting--;
+        lock->writer = true;
+    } else {
+        while (lock->writer || lock->writers_waiting != 0) {
+            file_lock_wait(lock);
+        }
+        lock->readers++;
+    }
+    if (validate_file_descriptor(fd) != FR_OK) {
+        file_release(fd, exclusive);
+        return FR_INVALID_PARAMETER;
+    }
+    return FR_OK;
+}
+
 // Checking if the descriptor is mapped to a valid object
 static inline FRESULT validate_dir_descriptor(uint64_t fd) {
     if ((fd < FAT_MAX_OPENED_DIRNUM) && dir_status[fd] == INUSE) {
@@ -76,6 +387,55 @@ static FRESULT validate_and_copy_path(uint64_t path, uint64_t len, char* memory)
     return FR_OK;
 }
 
+// Copy the iovec array to our private memory so the client cannot change it under us
+static FRESULT validate_and_copy_iov(fs_buffer_t iov, fs_buffer_t *memory, uint64_t *iovcnt) {
+    if (within_data_region(iov.offset, iov.size) != FR_OK) {
+        return FR_INVALID_PARAMETER;
+    }
+    if (iov.size == 0 || iov.size % sizeof(fs_buffer_t) != 0 || iov.size / sizeof(fs_buffer_t) > FS_MAX_IOV) {
+        return FR_INVALID_PARAMETER;
+    }
+    uint64_t count = iov.size / sizeof(fs_buffer_t);
+    memcpy(memory, client_data_addr + iov.offset, iov.size);
+    for (uint64_t i = 0; i < count; i++) {
+        if (within_data_region(memory[i].offset, memory[i].size) != FR_OK) {
+            return FR_INVALID_PARAMETER;
+        }
+    }
+    *iovcnt = count;
+    return FR_OK;
+}
+
+static void fill_stat(FILINFO *fileinfo, fs_stat_t *file_stat) {
+    memset(file_stat, 0, sizeof(fs_stat_t));
+    file_stat->atime = fileinfo->ftime;
+    file_stat->ctime = fileinfo->ftime;
+    file_stat->mtime = fileinfo->ftime;
+
+    file_stat->size = fileinfo->fsize;
+
+    // Now we have only one fat volume, so we can hard code it here
+    file_stat->blksize = fatfs[0].ssize;
+
+    // Study how is the structure of the mode, just leave it for now
+    file_stat->mode = 0;
+    if (fileinfo->fattrib & AM_DIR) {
+        file_stat->mode |= 040755; // Directory with rwx for owner, rx for group and others
+    } else {
+        // Assume regular file, apply read-only attribute
+        file_stat->mode |= 0444; // Readable by everyone
+    }
+    // Adjust for AM_RDO, if applicable
+    if (fileinfo->fattrib & AM_RDO) {
+        // If read-only and it's not a directory, remove write permissions.
+        // Note: For directories, AM_RDO doesn't make sense to apply as "write"
+        // because directories need to be writable for creating/removing files.
+        if (!(fileinfo->fattrib & AM_DIR)) {
+            file_stat->mode &= ~0222; // Remove write permissions
+        }
+    }
+}
+
 // Init the structure without using malloc
 // Could this have potential alignment issue?
 void init_metadata(uint64_t fs_metadata) {
@@ -103,6 +463,18 @@ void init_metadata(uint64_t fs_metadata) {
 
     // Allocate memory for dirs
     dirs = (DIR*)base;
+#if FF_USE_FASTSEEK
+    base += sizeof(DIR) * FAT_MAX_OPENED_DIRNUM;
+
+    // Allocate memory for the cluster link map tables
+    clmt_arena = (DWORD*)base;
+    base += sizeof(DWORD) * FAT_CLMT_ARENA_WORDS;
+#endif
+
+#if FF_USE_FREEMAP
+    // Allocate memory for the free cluster map
+    freemap_region = (uint64_t*)base;
+#endif
 }
 
 uint32_t find_free_file_obj(void) {
@@ -166,6 +538,11 @@ void fat_mount(void) {
     if (RET != FR_OK) {
         *fs_status = FREE;
     }
+#if FF_USE_FREEMAP
+    else if (fat_freemap_build(&(fatfs[0])) != FR_OK) {
+        LOG_FATFS("Free cluster map not available, allocating from the FAT\n");
+    }
+#endif
     LOG_FATFS("Mounting file system result: %d\n", RET);
     args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
 }
@@ -177,7 +554,15 @@ void fat_unmount(void) {
         return;
     }
     *fs_status = CLEANUP;
+    // Write back anything still held in the block cache before the volume goes away
+    if (disk_ioctl(0, CTRL_SYNC, NULL) != RES_OK) {
+        *fs_status = INUSE;
+        args->status = FS_STATUS_ERROR;
+        return;
+    }
     FRESULT RET = f_unmount("");
+    LOG_FATFS("Block cache hits: %lu misses: %lu evictions: %lu\n",
+              fat_cache_stats.hits, fat_cache_stats.misses, fat_cache_stats.evictions);
     if (RET == FR_OK) {
         *fs_status = FREE;
     }
@@ -216,6 +601,14 @@ void fat_open(void) {
     // Set the position to INUSE to indicate this file structure is in use
     file_status[fd] = INUSE;
     FIL* file = &(files[fd]);
+#ifdef FAT_READAHEAD
+    file_readahead[fd].next_offset = 0;
+    file_readahead[fd].window = 0;
+#endif
+#if FF_USE_FASTSEEK
+    file_clmt[fd].status = CLMT_NONE;
+    file_clmt[fd].size = 0;
+#endif
 
     unsigned char fat_flag = map_fs_flags_to_fat_flags(openflag);
 
@@ -250,7 +643,7 @@ void fat_pwrite(void) {
         args->status = FS_STATUS_INVALID_BUFFER;
         return;
     }
-    if ((RET = validate_file_descriptor(fd)) != FR_OK) {
+    if ((RET = file_acquire(fd, true)) != FR_OK) {
         LOG_FATFS("fat_write: invalid fd provided\n");
         args->result.file_write.len_written = 0;
         args->status = FS_STATUS_INVALID_FD;
@@ -260,9 +653,17 @@ void fat_pwrite(void) {
 
     FIL* file = &(files[fd]);
 
+#if FF_USE_FASTSEEK
+    if (offset + btw > f_size(file)) {
+        clmt_drop(fd);
+    } else {
+        clmt_build(fd, file, offset);
+    }
+#endif
     RET = f_lseek(file, offset);
 
     if (RET != FR_OK) {
+        file_release(fd, true);
         args->result.file_write.len_written = 0;
         args->status = FS_STATUS_ERROR;
         return;
@@ -270,7 +671,17 @@ void fat_pwrite(void) {
 
     uint32_t bw = 0;
 
+#ifdef FAT_DIRECT_IO
+    uint64_t head, size;
+    if ((file->flag & FA_WRITE) && direct_range(fd, file, offset, btw, &head, &size)) {
+        RET = direct_write(file, data, offset, btw, head, size, &bw);
+    } else {
+        RET = f_write(file, data, btw, &bw);
+    }
+#else
     RET = f_write(file, data, btw, &bw);
+#endif
+    file_release(fd, true);
 
     if (RET == FR_OK) {
         LOG_FATFS("fat_write: byte written: %u, content written: \n%.*s\n", bw, bw, (char *)data);
@@ -297,7 +708,7 @@ void fat_pread(void) {
         args->result.file_read.len_read = 0;
         return;
     }
-    if ((RET = validate_file_descriptor(fd)) != FR_OK) {
+    if ((RET = file_acquire(fd, false)) != FR_OK) {
         LOG_FATFS("fat_read: invalid fd provided\n");
         args->status = FS_STATUS_INVALID_FD;
         args->result.file_read.len_read = 0;
@@ -306,14 +717,19 @@ void fat_pread(void) {
 
     void* data = client_data_addr + buffer;
 
-    // Maybe add validation check of file descriptor here
-    FIL* file = &(files[fd]);
+    // Work on a copy of the file object so that concurrent reads each have their own position and sector buffer
+    FIL copy = files[fd];
+    FIL* file = &copy;
 
     LOG_FATFS("fat_read: bytes to be read: %lu, read offset: %lu\n", btr, offset);
 
+#if FF_USE_FASTSEEK
+    clmt_build(fd, file, offset);
+#endif
     RET = f_lseek(file, offset);
 
     if (RET != FR_OK) {
+        file_release(fd, false);
         args->status = FS_STATUS_ERROR;
         args->result.file_read.len_read = 0;
         return;
@@ -321,7 +737,24 @@ void fat_pread(void) {
 
     uint32_t br = 0;
 
+#ifdef FAT_READAHEAD
+    uint32_t window = readahead_window(fd, offset);
+#endif
+#ifdef FAT_DIRECT_IO
+    uint64_t head, size;
+    uint64_t len = (offset < f_size(file)) ? MIN(btr, f_size(file) - offset) : 0;
+    if ((file->flag & FA_READ) && direct_range(fd, file, offset, len, &head, &size)) {
+        RET = direct_read(file, data, offset, len, head, size, &br);
+    } else {
+        RET = f_read(file, data, btr, &br);
+    }
+#else
     RET = f_read(file, data, btr, &br);
+#endif
+    file_release(fd, false);
+#ifdef FAT_READAHEAD
+    readahead_done(fd, offset, br, window);
+#endif
 
     if (RET == FR_OK) {
         LOG_FATFS("fat_read: byte read: %u, content read: \n%.*s\n", br, br, (char *)data);
@@ -334,11 +767,195 @@ void fat_pread(void) {
     args->result.file_read.len_read = br;
 }
 
+void fat_pwritev(void) {
+    co_data_t *args = microkit_cothread_my_arg();
+    uint64_t fd = args->params.file_writev.fd;
+    uint64_t offset = args->params.file_writev.offset;
+
+    fs_buffer_t iov[FS_MAX_IOV];
+    uint64_t iovcnt;
+
+    args->result.file_writev.len_written = 0;
+
+    FRESULT RET = validate_and_copy_iov(args->params.file_writev.iov, iov, &iovcnt);
+    if (RET != FR_OK) {
+        LOG_FATFS("fat_writev: invalid iovec provided\n");
+        args->status = FS_STATUS_INVALID_BUFFER;
+        return;
+    }
+    if ((RET = file_acquire(fd, true)) != FR_OK) {
+        LOG_FATFS("fat_writev: invalid fd provided\n");
+        args->status = FS_STATUS_INVALID_FD;
+        return;
+    }
+
+    FIL* file = &(files[fd]);
+
+    LOG_FATFS("fat_writev: iovcnt: %lu, write offset: %lu\n", iovcnt, offset);
+
+#if FF_USE_FASTSEEK
+    uint64_t btw = 0;
+    for (uint64_t i = 0; i < iovcnt; i++) {
+        btw += iov[i].size;
+    }
+    if (offset + btw > f_size(file)) {
+        clmt_drop(fd);
+    } else {
+        clmt_build(fd, file, offset);
+    }
+#endif
+    RET = f_lseek(file, offset);
+    if (RET != FR_OK) {
+        file_release(fd, true);
+        args->status = FS_STATUS_ERROR;
+        return;
+    }
+
+    // The file position carries over from one buffer to the next, so only one seek is needed
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < iovcnt; i++) {
+        uint32_t bw = 0;
+        RET = f_write(file, client_data_addr + iov[i].offset, iov[i].size, &bw);
+        total += bw;
+        if (RET != FR_OK || bw < iov[i].size) {
+            break;
+        }
+    }
+    file_release(fd, true);
+
+    LOG_FATFS("fat_writev: byte written: %lu\n", total);
+
+    args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
+    args->result.file_writev.len_written = total;
+}
+
+void fat_preadv(void) {
+    co_data_t *args = microkit_cothread_my_arg();
+    uint64_t fd = args->params.file_readv.fd;
+    uint64_t offset = args->params.file_readv.offset;
+
+    fs_buffer_t iov[FS_MAX_IOV];
+    uint64_t iovcnt;
+
+    args->result.file_readv.len_read = 0;
+
+    FRESULT RET = validate_and_copy_iov(args->params.file_readv.iov, iov, &iovcnt);
+    if (RET != FR_OK) {
+        LOG_FATFS("fat_readv: invalid iovec provided\n");
+        args->status = FS_STATUS_INVALID_BUFFER;
+        return;
+    }
+    if ((RET = file_acquire(fd, false)) != FR_OK) {
+        LOG_FATFS("fat_readv: invalid fd provided\n");
+        args->status = FS_STATUS_INVALID_FD;
+        return;
+    }
+
+    // As in fat_pread, read through a private copy of the file object
+    FIL copy = files[fd];
+    FIL* file = &copy;
+
+    LOG_FATFS("fat_readv: iovcnt: %lu, read offset: %lu\n", iovcnt, offset);
+
+#if FF_USE_FASTSEEK
+    clmt_build(fd, file, offset);
+#endif
+    RET = f_lseek(file, offset);
+    if (RET != FR_OK) {
+        file_release(fd, false);
+        args->status = FS_STATUS_ERROR;
+        return;
+    }
+
+#ifdef FAT_READAHEAD
+    uint32_t window = readahead_window(fd, offset);
+#endif
+    // Stop at the first short read, as that means we have reached the end of the file
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < iovcnt; i++) {
+        uint32_t br = 0;
+        RET = f_read(file, client_data_addr + iov[i].offset, iov[i].size, &br);
+        total += br;
+        if (RET != FR_OK || br < iov[i].size) {
+            break;
+        }
+    }
+    file_release(fd, false);
+#ifdef FAT_READAHEAD
+    readahead_done(fd, offset, total, window);
+#endif
+
+    LOG_FATFS("fat_readv: byte read: %lu\n", total);
+
+    args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
+    args->result.file_readv.len_read = total;
+}
+
+void fat_fetch(void) {
+    co_data_t *args = microkit_cothread_my_arg();
+
+    uint64_t path = args->params.file_fetch.path.offset;
+    uint64_t path_len = args->params.file_fetch.path.size;
+    uint64_t stat_buffer = args->params.file_fetch.stat.offset;
+    uint64_t stat_size = args->params.file_fetch.stat.size;
+    uint64_t buffer = args->params.file_fetch.buf.offset;
+    uint64_t btr = args->params.file_fetch.buf.size;
+
+    char filepath[FS_MAX_PATH_LENGTH + 1];
+
+    args->result.file_fetch.len_read = 0;
+
+    FRESULT RET = within_data_region(stat_buffer, sizeof(fs_stat_t));
+    if (RET != FR_OK || stat_size < sizeof(fs_stat_t) || within_data_region(buffer, btr) != FR_OK) {
+        args->status = FS_STATUS_INVALID_BUFFER;
+        return;
+    }
+    if ((RET = validate_and_copy_path(path, path_len, filepath)) != FR_OK) {
+        args->status = FS_STATUS_INVALID_PATH;
+        return;
+    }
+
+    LOG_FATFS("fat_fetch: file path: %s, read size: %lu\n", filepath, btr);
+
+    FILINFO fileinfo;
+    RET = f_stat(filepath, &fileinfo);
+    if (RET != FR_OK) {
+        args->status = FS_STATUS_ERROR;
+        return;
+    }
+    fill_stat(&fileinfo, (fs_stat_t *)(client_data_addr + stat_buffer));
+
+    if (fileinfo.fattrib & AM_DIR) {
+        args->status = FS_STATUS_SUCCESS;
+        return;
+    }
+
+    // The file object never leaves this worker, so it does not take up a slot in the fd table
+    FIL file;
+    RET = f_open(&file, filepath, FA_READ | FA_OPEN_EXISTING);
+    if (RET != FR_OK) {
+        args->status = FS_STATUS_ERROR;
+        return;
+    }
+
+    uint32_t br = 0;
+    RET = f_read(&file, client_data_addr + buffer, btr, &br);
+    FRESULT CLOSE_RET = f_close(&file);
+    if (RET == FR_OK) {
+        RET = CLOSE_RET;
+    }
+
+    LOG_FATFS("fat_fetch: byte read: %u, result: %d\n", br, RET);
+
+    args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
+    args->result.file_fetch.len_read = br;
+}
+
 void fat_close(void) {
     co_data_t *args = microkit_cothread_my_arg();
     uint64_t fd = args->params.file_close.fd;
 
-    FRESULT RET = validate_file_descriptor(fd);
+    FRESULT RET = file_acquire(fd, true);
     if (RET != FR_OK) {
         LOG_FATFS("fat_close: Invalid file descriptor\n");
         args->status = FS_STATUS_INVALID_FD;
@@ -346,6 +963,9 @@ void fat_close(void) {
     }
 
     file_status[fd] = CLEANUP;
+#if FF_USE_FASTSEEK
+    clmt_drop(fd);
+#endif
 
     RET = f_close(&(files[fd]));
     if (RET == FR_OK) {
@@ -354,6 +974,7 @@ void fat_close(void) {
     else {
         file_status[fd] = INUSE;
     }
+    file_release(fd, true);
 
     args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
 }
@@ -389,33 +1010,7 @@ void fat_stat(void) {
         return;
     }
 
-    memset(file_stat, 0, sizeof(fs_stat_t));
-    file_stat->atime = fileinfo.ftime;
-    file_stat->ctime = fileinfo.ftime;
-    file_stat->mtime = fileinfo.ftime;
-
-    file_stat->size = fileinfo.fsize;
-
-// Now we have only one fat volume, so we can hard code it here
-    file_stat->blksize = fatfs[0].ssize;
-
-// Study how is the structure of the mode, just leave it for now
-    file_stat->mode = 0;
-    if (fileinfo.fattrib & AM_DIR) {
-        file_stat->mode |= 040755; // Directory with rwx for owner, rx for group and others
-    } else {
-        // Assume regular file, apply read-only attribute
-        file_stat->mode |= 0444; // Readable by everyone
-    }
-    // Adjust for AM_RDO, if applicable
-    if (fileinfo.fattrib & AM_RDO) {
-        // If read-only and it's not a directory, remove write permissions.
-        // Note: For directories, AM_RDO doesn't make sense to apply as "write"
-        // because directories need to be writable for creating/removing files.
-        if (!(fileinfo.fattrib & AM_DIR)) {
-            file_stat->mode &= ~0222; // Remove write permissions
-        }
-    }
+    fill_stat(&fileinfo, file_stat);
 
     args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
 }
@@ -482,7 +1077,7 @@ void fat_truncate(void) {
     uint64_t fd = args->params.file_truncate.fd;
     uint64_t len = args->params.file_truncate.length;
 
-    FRESULT RET = validate_file_descriptor(fd);
+    FRESULT RET = file_acquire(fd, true);
 
     // FD validation check
     if (RET != FR_OK) {
@@ -491,15 +1086,86 @@ void fat_truncate(void) {
         return;
     }
 
+#if FF_USE_FASTSEEK
+    clmt_drop(fd);
+#endif
     RET = f_lseek(&files[fd], len);
 
     if (RET != FR_OK) {
+        file_release(fd, true);
         LOG_FATFS("fat_truncate: Invalid file offset\n");
         args->status = FS_STATUS_ERROR;
         return;
     }
 
     RET = f_truncate(&files[fd]);
+    file_release(fd, true);
+
+    args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
+}
+
+#define ZERO_FILL_CHUNK 0x8000
+
+static const BYTE zero_fill_buf[ZERO_FILL_CHUNK];
+
+static FRESULT zero_fill(FIL *file, FSIZE_t start, FSIZE_t end) {
+    FRESULT RET = f_lseek(file, start);
+    while (RET == FR_OK && start < end) {
+        UINT btw = (end - start < ZERO_FILL_CHUNK) ? (UINT)(end - start) : ZERO_FILL_CHUNK;
+        UINT bw;
+        RET = f_write(file, zero_fill_buf, btw, &bw);
+        if (RET == FR_OK && bw < btw) {
+            RET = FR_DENIED;
+        }
+        start += bw;
+    }
+    return RET;
+}
+
+void fat_allocate(void) {
+    co_data_t *args = microkit_cothread_my_arg();
+
+    uint64_t fd = args->params.file_allocate.fd;
+    uint64_t offset = args->params.file_allocate.offset;
+    uint64_t length = args->params.file_allocate.length;
+    uint64_t end = offset + length;
+
+    FRESULT RET = file_acquire(fd, true);
+    if (RET != FR_OK) {
+        LOG_FATFS("fat_allocate: Invalid FD\n");
+        args->status = FS_STATUS_INVALID_FD;
+        return;
+    }
+
+    FIL *file = &files[fd];
+    FSIZE_t old_size = f_size(file);
+    if (length == 0 || end < offset) {
+        RET = FR_INVALID_PARAMETER;
+    } else if (end > old_size) {
+#if FF_USE_FASTSEEK
+        clmt_drop(fd);
+#endif
+        // An empty file can be given one contiguous block of clusters
+        RET = (old_size == 0) ? f_expand(file, end, 1) : FR_DENIED;
+        // Otherwise, or if there is no contiguous block large enough, grow the file from its end
+        if (RET == FR_DENIED) {
+            RET = f_lseek(file, end);
+            if (RET == FR_OK && f_size(file) < end) {
+                RET = FR_DENIED;
+            }
+        }
+        // The new clusters still hold whatever was last written to them on disk
+        if (RET == FR_OK) {
+            RET = zero_fill(file, old_size, end);
+        }
+        if (RET != FR_OK && f_size(file) > old_size) {
+            f_lseek(file, old_size);
+            f_truncate(file);
+        }
+    }
+    file_release(fd, true);
+
+    LOG_FATFS("fat_allocate: offset: %lu, length: %lu, result: %d\n", offset, length, RET);
 
     args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
 }
@@ -638,6 +1304,69 @@ void fat_readdir(void) {
     args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
 }
 
+void fat_readdir_batch(void) {
+    co_data_t *args = microkit_cothread_my_arg();
+
+    uint64_t fd = args->params.dir_read_batch.fd;
+    uint64_t buffer = args->params.dir_read_batch.buf.offset;
+    uint64_t size = args->params.dir_read_batch.buf.size;
+
+    LOG_FATFS("FAT readdir_batch file descriptor: %lu\n", fd);
+
+    FRESULT RET = within_data_region(buffer, size);
+    if (RET != FR_OK || size < FS_DIRENT_SIZE(FS_MAX_NAME_LENGTH)) {
+        LOG_FATFS("fat_readdir_batch: Invalid buffer\n");
+        args->status = FS_STATUS_INVALID_BUFFER;
+        return;
+    }
+    if ((RET = validate_dir_descriptor(fd)) != FR_OK) {
+        LOG_FATFS("fat_readdir_batch: Invalid FD\n");
+        args->status = FS_STATUS_INVALID_FD;
+        return;
+    }
+
+    DIR* dp = &(dirs[fd]);
+    char *out = client_data_addr + buffer;
+    uint64_t used = 0;
+    uint64_t count = 0;
+
+    FILINFO fno;
+    fs_dirent_t dirent;
+    for (;;) {
+        // Keep a copy of the directory object so that an entry that does not fit
+        // can be pushed back and returned by the next call instead
+        DIR saved = *dp;
+        RET = f_readdir(dp, &fno);
+        if (RET != FR_OK || fno.fname[0] == 0) {
+            break;
+        }
+
+        uint64_t len = strlen(fno.fname);
+        if (used + FS_DIRENT_SIZE(len) > size) {
+            *dp = saved;
+            break;
+        }
+
+        fill_stat(&fno, &dirent.stat);
+        dirent.name_len = len;
+        memcpy(out + used, &dirent, sizeof(fs_dirent_t));
+        memcpy(out + used + sizeof(fs_dirent_t), fno.fname, len);
+        used += FS_DIRENT_SIZE(len);
+        count++;
+    }
+
+    LOG_FATFS("FAT readdir_batch entries: %lu\n", count);
+
+    args->result.dir_read_batch.num_entries = count;
+    args->result.dir_read_batch.cookie = f_telldir(dp);
+    if (RET == FR_OK && count == 0) {
+        args->status = FS_STATUS_END_OF_DIRECTORY;
+        return;
+    }
+    // Entries already packed into the buffer are still returned if a later read failed
+    args->status = (RET == FR_OK || count != 0) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
+}
+
 // Not sure if this one is implemented correctly
 void fat_telldir(void){
     co_data_t *args = microkit_cothread_my_arg();
@@ -682,7 +1411,7 @@ void fat_sync(void) {
     // Maybe add validation check of file descriptor here
     uint64_t fd = args->params.file_sync.fd;
 
-    FRESULT RET = validate_file_descriptor(fd);
+    FRESULT RET = file_acquire(fd, true);
     if (RET != FR_OK) {
         LOG_FATFS("fat_sync: Invalid file descriptor %lu\n", fd);
         args->status = FS_STATUS_INVALID_FD;
@@ -690,6 +1419,7 @@ void fat_sync(void) {
     }
 
     RET = f_sync(&(files[fd]));
+    file_release(fd, true);
 
     args->status = (RET == FR_OK) ? FS_STATUS_SUCCESS : FS_STATUS_ERROR;
 }
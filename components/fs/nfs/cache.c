@@ -0,0 +1,233 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <microkit.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <sddf/timer/client.h>
+
+#include "nfs.h"
+#include "cache.h"
+
+/*
+ * Attributes and failed lookups are cached by path, so that stats of the same few paths are
+ * answered without a round trip to the server. Each entry stays valid for a timeout that starts
+ * at the minimum for its kind and doubles every time the server confirms the attributes have
+ * not changed, as the Linux client does with acregmin/acregmax.
+ *
+ * Requests that could bring attributes back take a ticket with attr_cache_begin() before they
+ * are sent, and only fill the entry if nothing invalidated it in the meantime. Local changes
+ * invalidate the affected entries when they complete, and opening a path always drops its
+ * entry, so a client that reopens a file sees what the server has (close-to-open consistency).
+ *
+ * Paths are normalised before they are hashed or compared, so "a/b", "/a//b" and "./a/b/" all share
+ * one entry and invalidating any of them drops it. ".." is left alone, as it depends on symlinks.
+ */
+
+_Static_assert((NFS_ATTR_CACHE_ENTRIES & (NFS_ATTR_CACHE_ENTRIES - 1)) == 0,
+               "NFS_ATTR_CACHE_ENTRIES must be a power of two");
+
+struct attr_cache_entry {
+    enum {
+        entry_empty,
+        entry_pending,
+        entry_positive,
+        entry_negative,
+    } state;
+    uint32_t generation;
+    uint64_t key;
+    uint64_t expiry;
+    // Last timeout handed out for the attributes in stat, 0 if there are none
+    uint64_t timeout;
+    fs_stat_t stat;
+    char path[NFS_ATTR_CACHE_PATH_MAX + 1];
+};
+
+static struct attr_cache_entry attr_cache[NFS_ATTR_CACHE_ENTRIES];
+
+static uint64_t now(void) {
+    return sddf_timer_time_now(TIMER_CHANNEL);
+}
+
+static struct attr_cache_entry *entry_for_key(uint64_t key) {
+    return &attr_cache[key & (NFS_ATTR_CACHE_ENTRIES - 1)];
+}
+
+static int entry_matches(struct attr_cache_entry *entry, uint64_t key, const char *path) {
+    return entry->state != entry_empty && entry->key == key && strcmp(entry->path, path) == 0;
+}
+
+static void entry_clear(struct attr_cache_entry *entry) {
+    entry->state = entry_empty;
+    entry->timeout = 0;
+    entry->generation++;
+}
+
+static int stat_unchanged(const fs_stat_t *a, const fs_stat_t *b) {
+    return a->ino == b->ino && a->mode == b->mode && a->size == b->size
+        && a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec
+        && a->ctime == b->ctime && a->ctime_nsec == b->ctime_nsec;
+}
+
+/*
+ * Copy path into norm without leading, trailing or repeated slashes and "." segments.
+ * Returns false if the result is longer than NFS_ATTR_CACHE_PATH_MAX.
+ */
+static bool normalise_path(const char *path, char norm[NFS_ATTR_CACHE_PATH_MAX + 1]) {
+    size_t len = 0;
+    const char *c = path;
+    while (*c != '\0') {
+        if (*c == '/') {
+            c++;
+            continue;
+        }
+        const char *end = c;
+        while (*end != '\0' && *end != '/') {
+            end++;
+        }
+        size_t seg_len = end - c;
+        if (seg_len == 1 && c[0] == '.') {
+            c = end;
+            continue;
+        }
+        size_t sep = (len > 0) ? 1 : 0;
+        if (len + sep + seg_len > NFS_ATTR_CACHE_PATH_MAX) {
+            return false;
+        }
+        if (sep) {
+            norm[len++] = '/';
+        }
+        memcpy(norm + len, c, seg_len);
+        len += seg_len;
+        c = end;
+    }
+    norm[len] = '\0';
+    return true;
+}
+
+static uint64_t hash_path(const char *path) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+uint64_t attr_cache_key(const char *path) {
+    char norm[NFS_ATTR_CACHE_PATH_MAX + 1];
+    // A path too long to normalise is never cached, so any key will do
+    if (!normalise_path(path, norm)) {
+        return hash_path(path);
+    }
+    return hash_path(norm);
+}
+
+int attr_cache_lookup(const char *path, fs_stat_t *stat) {
+    char norm[NFS_ATTR_CACHE_PATH_MAX + 1];
+    if (!normalise_path(path, norm)) {
+        return ATTR_CACHE_MISS;
+    }
+    uint64_t key = hash_path(norm);
+    struct attr_cache_entry *entry = entry_for_key(key);
+
+    if (!entry_matches(entry, key, norm) || now() >= entry->expiry) {
+        return ATTR_CACHE_MISS;
+    }
+
+    switch (entry->state) {
+    case entry_positive:
+        memcpy(stat, &entry->stat, sizeof (fs_stat_t));
+        return ATTR_CACHE_HIT;
+    case entry_negative:
+        return ATTR_CACHE_NEGATIVE;
+    default:
+        return ATTR_CACHE_MISS;
+    }
+}
+
+uint64_t attr_cache_begin(const char *path) {
+    char norm[NFS_ATTR_CACHE_PATH_MAX + 1];
+    if (!normalise_path(path, norm)) {
+        return ATTR_CACHE_NO_TICKET;
+    }
+
+    uint64_t key = hash_path(norm);
+    struct attr_cache_entry *entry = entry_for_key(key);
+
+    // Keep the old attributes of the same path around to compare against the new ones
+    if (!entry_matches(entry, key, norm)) {
+        entry->key = key;
+        entry->timeout = 0;
+        strcpy(entry->path, norm);
+    }
+    entry->state = entry_pending;
+    entry->generation++;
+
+    return ((uint64_t)entry->generation << 32) | (uint64_t)(entry - attr_cache);
+}
+
+void attr_cache_fill(uint64_t ticket, int status, const fs_stat_t *stat) {
+    if (ticket == ATTR_CACHE_NO_TICKET) {
+        return;
+    }
+
+    struct attr_cache_entry *entry = &attr_cache[ticket & 0xffffffff];
+    if (entry->state != entry_pending || entry->generation != ticket >> 32) {
+        return;
+    }
+
+    if (status == -ENOENT) {
+        entry->state = entry_negative;
+        entry->timeout = 0;
+        uint64_t timeout = (uint64_t)(NFS_ACDIRMIN < NFS_ACDIRMAX ? NFS_ACDIRMIN : NFS_ACDIRMAX) * NS_IN_S;
+        entry->expiry = now() + timeout;
+        return;
+    }
+    if (status != 0) {
+        entry_clear(entry);
+        return;
+    }
+
+    uint64_t min = (uint64_t)NFS_ACREGMIN * NS_IN_S;
+    uint64_t max = (uint64_t)NFS_ACREGMAX * NS_IN_S;
+    if (S_ISDIR(stat->mode)) {
+        min = (uint64_t)NFS_ACDIRMIN * NS_IN_S;
+        max = (uint64_t)NFS_ACDIRMAX * NS_IN_S;
+    }
+
+    uint64_t timeout = min;
+    if (entry->timeout != 0 && stat_unchanged(&entry->stat, stat)) {
+        timeout = entry->timeout * 2;
+    }
+    if (timeout > max) {
+        timeout = max;
+    }
+
+    memcpy(&entry->stat, stat, sizeof (fs_stat_t));
+    entry->state = entry_positive;
+    entry->timeout = timeout;
+    entry->expiry = now() + timeout;
+}
+
+void attr_cache_invalidate(uint64_t key) {
+    struct attr_cache_entry *entry = entry_for_key(key);
+    if (entry->state != entry_empty && entry->key == key) {
+        entry_clear(entry);
+    }
+}
+
+void attr_cache_invalidate_all(void) {
+    for (int i = 0; i < NFS_ATTR_CACHE_ENTRIES; i++) {
+        if (attr_cache[i].state != entry_empty) {
+            entry_clear(&attr_cache[i]);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <lions/fs/protocol.h>
+
+/*
+ * Attribute cache timeouts in seconds, with the same meaning as the acregmin, acregmax,
+ * acdirmin and acdirmax NFS mount options. Setting the maximums to 0 disables the cache.
+ */
+#ifndef NFS_ACREGMIN
+#define NFS_ACREGMIN 3
+#endif
+#ifndef NFS_ACREGMAX
+#define NFS_ACREGMAX 60
+#endif
+#ifndef NFS_ACDIRMIN
+#define NFS_ACDIRMIN 30
+#endif
+#ifndef NFS_ACDIRMAX
+#define NFS_ACDIRMAX 60
+#endif
+
+// Number of paths whose attributes are cached, must be a power of two
+#ifndef NFS_ATTR_CACHE_ENTRIES
+#define NFS_ATTR_CACHE_ENTRIES 256
+#endif
+
+// Paths longer than this once normalised are never cached
+#ifndef NFS_ATTR_CACHE_PATH_MAX
+#define NFS_ATTR_CACHE_PATH_MAX 255
+#endif
+
+#define ATTR_CACHE_MISS 0
+#define ATTR_CACHE_HIT 1
+#define ATTR_CACHE_NEGATIVE 2
+
+#define ATTR_CACHE_NO_TICKET UINT64_MAX
+
+uint64_t attr_cache_key(const char *path);
+int attr_cache_lookup(const char *path, fs_stat_t *stat);
+uint64_t attr_cache_begin(const char *path);
+void attr_cache_fill(uint64_t ticket, int status, const fs_stat_t *stat);
+void attr_cache_invalidate(uint64_t key);
+void attr_cache_invalidate_all(void);
@@ -31,70 +31,73 @@
 #error "Expected CLIENT_CHANNEL to be defined"
 #endif
 
-#define TIMEOUT (1 * NS_IN_MS)
-
 char *serial_tx_data;
 serial_queue_t *serial_tx_queue;
 serial_queue_handle_t serial_tx_queue_handle;
 
-struct nfs_context *nfs;
+struct nfs_context *nfs_conns[NFS_CONNECTIONS];
 
-void nfs_connect_cb(int err, struct nfs_context *nfs_ctx, void *data, void *private_data) {
-    if (!err) {
-        process_commands();
-        dlog("connected to nfs server");
-    } else {
-        dlog("failed to connect to nfs server (%d): %s", err, data);
-    }
-}
+/*
+ * The PD only runs when there is something to do: packets to receive, client commands, or a
+ * timeout due. libnfs is serviced whenever its socket may have become ready, and the timer is
+ * armed for the earliest lwIP timeout, or not at all if there is none. No RPC timeout is set
+ * for libnfs, so it has no deadlines of its own. The sDDF timer cannot cancel a timeout, so a
+ * new one is only set when it is due before the one already armed.
+ */
+static uint64_t timer_deadline = UINT64_MAX;
 
-void nfs_init(void) {
-    nfs = nfs_init_context();
-    if (nfs == NULL) {
-        dlog("failed to init nfs context");
+static void timer_rearm(void) {
+    uint32_t sleep_ms = tcp_next_timeout();
+    if (sleep_ms == UINT32_MAX) {
         return;
     }
+    uint64_t now = sddf_timer_time_now(TIMER_CHANNEL);
+    uint64_t deadline = now + (uint64_t)sleep_ms * NS_IN_MS;
+    if (timer_deadline <= now || deadline < timer_deadline) {
+        sddf_timer_set_timeout(TIMER_CHANNEL, deadline - now);
+        timer_deadline = deadline;
+    }
+}
 
-    /*
-     * We want to have the NFS client attempt to re-connect indefinitely when our connection
-     * with the server is closed or dropped.
-     */
-    nfs_set_autoreconnect(nfs, -1);
+static void nfs_poll(struct nfs_context *nfs) {
+    int nfs_fd = nfs_get_fd(nfs);
+    int socket_index = socket_index_of_fd(nfs_fd);
+    int revents = nfs_which_events(nfs);
+    int sevents = 0;
+    if (tcp_socket_hup(socket_index)) {
+        sevents |= POLLHUP;
+    }
+    if (tcp_socket_err(socket_index)) {
+        sevents |= POLLERR;
+    }
+    if (revents & POLLOUT && tcp_socket_writable(socket_index)) {
+        sevents |= POLLOUT;
+    }
+    if (revents & POLLIN && tcp_socket_readable(socket_index)) {
+        sevents |= POLLIN;
+    }
+    if (sevents) {
+        int err = nfs_service(nfs, sevents);
+        dlogp(err, "nfs_service error");
+    }
+}
 
-    int err = nfs_mount_async(nfs, NFS_SERVER, NFS_DIRECTORY, nfs_connect_cb, NULL);
-    dlogp(err, "failed to connect to nfs server");
+// Completions from every connection go to the one completion queue
+static void nfs_poll_all(void) {
+    for (int i = 0; i < NFS_CONNECTIONS; i++) {
+        if (nfs_conns[i] != NULL) {
+            nfs_poll(nfs_conns[i]);
+        }
+    }
 }
 
 void notified(microkit_channel ch) {
     switch (ch) {
-    case TIMER_CHANNEL: {
-        tcp_process_rx();
-        tcp_update();
-        if (nfs != NULL) {
-            int nfs_fd = nfs_get_fd(nfs);
-            int socket_index = socket_index_of_fd(nfs_fd);
-            int revents = nfs_which_events(nfs);
-            int sevents = 0;
-            if (tcp_socket_hup(socket_index)) {
-                sevents |= POLLHUP;
-            }
-            if (tcp_socket_err(socket_index)) {
-                sevents |= POLLERR;
-            }
-            if (revents & POLLOUT && tcp_socket_writable(socket_index)) {
-                sevents |= POLLOUT;
-            }
-            if (revents & POLLIN && tcp_socket_readable(socket_index)) {
-                sevents |= POLLIN;
-            }
-            if (sevents) {
-                int err = nfs_service(nfs, sevents);
-                dlogp(err, "nfs_service error");
-            }
+    case TIMER_CHANNEL:
+        if (timer_deadline <= sddf_timer_time_now(TIMER_CHANNEL)) {
+            timer_deadline = UINT64_MAX;
         }
-        sddf_timer_set_timeout(TIMER_CHANNEL, TIMEOUT);
         break;
-    }
     case ETHERNET_RX_CHANNEL:
         tcp_process_rx();
         break;
@@ -112,12 +115,19 @@ void notified(microkit_channel ch) {
         break;
     }
 
+    // Only runs the timeouts that are due
+    tcp_update();
+    nfs_poll_all();
+
     // If we leave any commands in the queue, we can't rely on another client
     // notification to cause us to try to reprocess those commands, hence we
     // try to process commands unconditionally on any notification
     if (tcp_ready()) {
         process_commands();
+        // Send the RPCs the commands have queued without waiting for another event
+        nfs_poll_all();
     }
+    timer_rearm();
     tcp_maybe_notify();
 }
 
@@ -128,5 +138,5 @@ void init(void)
     syscalls_init();
     continuation_pool_init();
     tcp_init_0();
-    sddf_timer_set_timeout(TIMER_CHANNEL, TIMEOUT);
+    timer_rearm();
 }
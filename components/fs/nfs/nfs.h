@@ -2,6 +2,8 @@
  * Copyright 2023, UNSW
  * SPDX-License-Identifier: BSD-2-Clause
  */
+#pragma once
+
 #include <sddf/serial/queue.h>
 
 #define SERIAL_TX_CH 0
@@ -10,12 +12,19 @@
 #define CLIENT_CHANNEL 7
 #define TIMER_CHANNEL 9
 
+// Number of connections to the NFS server, requests are spread across them
+#ifndef NFS_CONNECTIONS
+#define NFS_CONNECTIONS 2
+#endif
+
 extern serial_queue_handle_t serial_tx_queue_handle;
 
-extern struct nfs_context *nfs;
+extern struct nfs_context *nfs_conns[NFS_CONNECTIONS];
 
 void continuation_pool_init(void);
 void process_commands(void);
+// Whether [buf, buf + len) lies within the client share
+int in_client_share(const void *buf, uint64_t len);
 
 int must_notify_rx(void);
 int must_notify_tx(void);
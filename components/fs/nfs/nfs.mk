@@ -10,6 +10,8 @@
 # Generates nfs.elf
 # Requires ${SDDF}/util/util.mk to build the utility library for debug output
 # Requires CONFIG_INCLUDE, NFS_SERVER and NFS_DIRECTORY to be defined
+# NFS_CLIENT_SHARE_SIZE may be defined to set the size of the mapped client data region,
+# which covers every client region when serving clients through the fs virtualiser
 
 NFS_DIR := $(LIONSOS)/components/fs/nfs
 LWIP := $(SDDF)/network/ipstacks/lwip/src
@@ -24,6 +26,10 @@ CFLAGS_nfs := \
 	-I$(LWIP)/include \
 	-I$(LWIP)/include/ipv4 \
 
+ifdef NFS_CLIENT_SHARE_SIZE
+	CFLAGS_nfs += -DCLIENT_SHARE_SIZE=$(NFS_CLIENT_SHARE_SIZE)
+endif
+
 include $(LWIP)/Filelists.mk
 $(LWIP)/Filelists.mk:
 	cd $(LIONSOS); git submodule update --init $(SDDF)
@@ -34,7 +40,7 @@ NFS_LWIP_OBJ := $(addprefix nfs/lwip/, $(NFS_LWIPFILES:.c=.o))
 
 NFS_DIRS := nfs $(addprefix nfs/lwip/, api core core/ipv4 netif)
 
-NFS_FILES := nfs.c fd.c op.c posix.c tcp.c
+NFS_FILES := nfs.c fd.c op.c posix.c tcp.c cache.c
 NFS_OBJ := $(addprefix nfs/, $(NFS_FILES:.c=.o)) $(NFS_LWIP_OBJ)
 
 CHECK_NFS_FLAGS_MD5 := .nfs_cflags-$(shell echo -- $(CFLAGS) $(CFLAGS_nfs) | shasum | sed 's/ *-//')
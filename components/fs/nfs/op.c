@@ -24,9 +24,12 @@
 #include "nfs.h"
 #include "util.h"
 #include "fd.h"
+#include "cache.h"
 
 #define MAX_CONCURRENT_OPS FS_QUEUE_CAPACITY
+#ifndef CLIENT_SHARE_SIZE
 #define CLIENT_SHARE_SIZE 0x4000000
+#endif
 
 struct fs_queue *command_queue;
 struct fs_queue *completion_queue;
@@ -36,13 +39,30 @@ char path_buffer[2][FS_MAX_PATH_LENGTH + 1];
 
 struct continuation {
     uint64_t request_id;
-    uint64_t data[4];
+    uint64_t data[8];
     struct continuation *next_free;
 };
 
 struct continuation continuation_pool[MAX_CONCURRENT_OPS];
 struct continuation *first_free_cont;
 
+/*
+ * Vectored requests work from their own copy of the client's iovec array, taken and checked
+ * once when the request arrives, as the client can rewrite the share at any time.
+ */
+#ifndef NFS_MAX_CONCURRENT_IOV
+#define NFS_MAX_CONCURRENT_IOV 64
+#endif
+_Static_assert(NFS_MAX_CONCURRENT_IOV > 0 && NFS_MAX_CONCURRENT_IOV <= 64,
+               "iovec pool is tracked in a 64-bit mask");
+#define IOV_POOL_MASK (UINT64_MAX >> (64 - NFS_MAX_CONCURRENT_IOV))
+
+fs_buffer_t iov_pool[NFS_MAX_CONCURRENT_IOV][FS_MAX_IOV];
+uint64_t iov_pool_used;
+
+// Attribute cache key of the path each open file was opened by, to invalidate when it changes
+uint64_t fd_cache_key[MAX_OPEN_FILES];
+
 void handle_initialise(fs_cmd_t cmd);
 void handle_deinitialise(fs_cmd_t cmd);
 void handle_open(fs_cmd_t cmd);
@@ -63,6 +83,11 @@ void handle_fsync(fs_cmd_t cmd);
 void handle_seekdir(fs_cmd_t cmd);
 void handle_telldir(fs_cmd_t cmd);
 void handle_rewinddir(fs_cmd_t cmd);
+void handle_readv(fs_cmd_t cmd);
+void handle_writev(fs_cmd_t cmd);
+void handle_fetch(fs_cmd_t cmd);
+void handle_readdir_batch(fs_cmd_t cmd);
+void handle_allocate(fs_cmd_t cmd);
 
 static void (*const cmd_handler[FS_NUM_COMMANDS])(fs_cmd_t cmd) = {
     [FS_CMD_INITIALISE] = handle_initialise,
@@ -85,6 +110,11 @@ static void (*const cmd_handler[FS_NUM_COMMANDS])(fs_cmd_t cmd) = {
     [FS_CMD_DIR_SEEK] = handle_seekdir,
     [FS_CMD_DIR_TELL] = handle_telldir,
     [FS_CMD_DIR_REWIND] = handle_rewinddir,
+    [FS_CMD_FILE_READV] = handle_readv,
+    [FS_CMD_FILE_WRITEV] = handle_writev,
+    [FS_CMD_FILE_FETCH] = handle_fetch,
+    [FS_CMD_DIR_READ_BATCH] = handle_readdir_batch,
+    [FS_CMD_FILE_ALLOCATE] = handle_allocate,
 };
 
 void reply(fs_cmpl_t cmpl) {
@@ -143,6 +173,47 @@ void *get_buffer(fs_buffer_t buf) {
     return (void *)(client_share + buf.offset);
 }
 
+int in_client_share(const void *buf, uint64_t len) {
+    uintptr_t start = (uintptr_t)client_share;
+    return (uintptr_t)buf >= start && (uintptr_t)buf - start <= CLIENT_SHARE_SIZE
+        && len <= CLIENT_SHARE_SIZE - ((uintptr_t)buf - start);
+}
+
+fs_buffer_t *iov_alloc(void) {
+    uint64_t free = ~iov_pool_used & IOV_POOL_MASK;
+    if (free == 0) {
+        return NULL;
+    }
+    int i = __builtin_ctzll(free);
+    iov_pool_used |= 1ULL << i;
+    return iov_pool[i];
+}
+
+void iov_free(fs_buffer_t *iov) {
+    uint64_t i = (iov - iov_pool[0]) / FS_MAX_IOV;
+    assert(i < NFS_MAX_CONCURRENT_IOV);
+    assert(iov_pool_used & (1ULL << i));
+    iov_pool_used &= ~(1ULL << i);
+}
+
+// Copies the iovec array described by buf into iov and checks every entry of the copy
+int copy_iov(fs_buffer_t *iov, fs_buffer_t buf, uint64_t *iovcnt) {
+    fs_buffer_t *client_iov = get_buffer(buf);
+    if (client_iov == NULL
+        || buf.size % sizeof(fs_buffer_t) != 0
+        || buf.size / sizeof(fs_buffer_t) > FS_MAX_IOV) {
+        return -1;
+    }
+    memcpy(iov, client_iov, buf.size);
+    for (uint64_t i = 0; i < buf.size / sizeof(fs_buffer_t); i++) {
+        if (get_buffer(iov[i]) == NULL) {
+            return -1;
+        }
+    }
+    *iovcnt = buf.size / sizeof(fs_buffer_t);
+    return 0;
+}
+
 char *copy_path(int slot, fs_buffer_t buf) {
     assert(0 <= slot && slot < 2);
 
@@ -156,21 +227,39 @@ char *copy_path(int slot, fs_buffer_t buf) {
     return path_buffer[slot];
 }
 
+/*
+ * With NFS_CONNECTIONS above one, each connection has its own libnfs context and TCP socket.
+ * A file or directory stays on the connection it was opened on, chosen by its fd, as libnfs
+ * handles belong to a context. Requests that only name a path take the connections in turn.
+ */
+static struct nfs_context *nfs_for_fd(fd_t fd) {
+    return nfs_conns[(fd % MAX_OPEN_FILES) % NFS_CONNECTIONS];
+}
+
+static struct nfs_context *nfs_next(void) {
+    static uint32_t next;
+    struct nfs_context *nfs = nfs_conns[next];
+    next = (next + 1) % NFS_CONNECTIONS;
+    return nfs;
+}
+
+/* The client is replied to once every connection has been mounted, data[0] counts those yet to finish */
 static void mount_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
     struct continuation *cont = private_data;
-    fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
 
     if (status != 0) {
         dlog("failed to connect to nfs server (%d): %s", status, data);
-        cmpl.status = FS_STATUS_ERROR;
-        goto fail;
+        cont->data[1] = FS_STATUS_ERROR;
+    } else {
+        dlog("connected to nfs server");
     }
 
-    dlog("connected to nfs server");
-
-fail:
-    continuation_free(cont);
-    reply(cmpl);
+    cont->data[0]--;
+    if (cont->data[0] == 0) {
+        fs_cmpl_t cmpl = { .id = cont->request_id, .status = cont->data[1], .data = {0} };
+        continuation_free(cont);
+        reply(cmpl);
+    }
 }
 
 void handle_initialise(fs_cmd_t cmd) {
@@ -178,28 +267,39 @@ void handle_initialise(fs_cmd_t cmd) {
 
     dlog("received initialise command");
 
-    if (nfs != NULL) {
+    if (nfs_conns[0] != NULL) {
         dlog("duplicate initialise command from client");
         goto fail_duplicate;
     }
 
-    nfs = nfs_init_context();
-    if (nfs == NULL) {
-        dlog("failed to init nfs context");
-        goto fail_init;
+    for (int i = 0; i < NFS_CONNECTIONS; i++) {
+        nfs_conns[i] = nfs_init_context();
+        if (nfs_conns[i] == NULL) {
+            dlog("failed to init nfs context");
+            goto fail_init;
+        }
+        /* Infinite retries */
+        nfs_set_autoreconnect(nfs_conns[i], -1);
     }
 
     struct continuation *cont = continuation_alloc();
     assert(cont != NULL);
     cont->request_id = cmd.id;
-
-    /* Infinite retries */
-    nfs_set_autoreconnect(nfs, -1);
-
-    int err = nfs_mount_async(nfs, NFS_SERVER, NFS_DIRECTORY, mount_cb, cont);
-    if (err) {
-        dlog("failed to enqueue command");
-        goto fail_mount;
+    cont->data[0] = NFS_CONNECTIONS;
+    cont->data[1] = FS_STATUS_SUCCESS;
+
+    for (int i = 0; i < NFS_CONNECTIONS; i++) {
+        int err = nfs_mount_async(nfs_conns[i], NFS_SERVER, NFS_DIRECTORY, mount_cb, cont);
+        if (err) {
+            dlog("failed to enqueue command");
+            /* The mounts already under way reply to the client when they finish */
+            cont->data[1] = FS_STATUS_ERROR;
+            cont->data[0] -= NFS_CONNECTIONS - i;
+            if (cont->data[0] == 0) {
+                goto fail_mount;
+            }
+            return;
+        }
     }
 
     return;
@@ -207,6 +307,12 @@ void handle_initialise(fs_cmd_t cmd) {
 fail_mount:
     continuation_free(cont);
 fail_init:
+    for (int i = 0; i < NFS_CONNECTIONS; i++) {
+        if (nfs_conns[i] != NULL) {
+            nfs_destroy_context(nfs_conns[i]);
+            nfs_conns[i] = NULL;
+        }
+    }
 fail_duplicate:
     reply((fs_cmpl_t){ .id = cmd.id, .status = status, .data = {0} });
 }
@@ -221,8 +327,10 @@ static void stat64_cb(int status, struct nfs_context *nfs, void *data, void *pri
 
     if (status == 0) {
         memcpy(buf, data, sizeof (fs_stat_t));
+        attr_cache_fill(cont->data[1], status, data);
     } else {
         dlogp(status != -ENOENT, "failed to stat file (%d): %s", status, data);
+        attr_cache_fill(cont->data[1], status, NULL);
         cmpl.status = FS_STATUS_ERROR;
     }
     continuation_free(cont);
@@ -247,12 +355,22 @@ void handle_stat(fs_cmd_t cmd) {
         goto fail_buffer;
     }
 
+    switch (attr_cache_lookup(path, buf)) {
+    case ATTR_CACHE_HIT:
+        reply((fs_cmpl_t){ .id = cmd.id, .status = FS_STATUS_SUCCESS, .data = {0} });
+        return;
+    case ATTR_CACHE_NEGATIVE:
+        reply((fs_cmpl_t){ .id = cmd.id, .status = FS_STATUS_ERROR, .data = {0} });
+        return;
+    }
+
     struct continuation *cont = continuation_alloc();
     assert(cont != NULL);
     cont->request_id = cmd.id;
     cont->data[0] = (uint64_t)buf;
+    cont->data[1] = attr_cache_begin(path);
 
-    int err = nfs_stat64_async(nfs, path, stat64_cb, cont);
+    int err = nfs_stat64_async(nfs_next(), path, stat64_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -302,7 +420,7 @@ void handle_fsize(fs_cmd_t cmd) {
     cont->request_id = cmd.id;
     cont->data[0] = params.fd;
 
-    err = nfs_fstat64_async(nfs, file_handle, fsize_cb, cont);
+    err = nfs_fstat64_async(nfs_for_fd(params.fd), file_handle, fsize_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -323,6 +441,8 @@ void open_cb(int status, struct nfs_context *nfs, void *data, void *private_data
     struct nfsfh *file = data;
     fd_t fd = cont->data[0];
 
+    // The open may have created the file
+    attr_cache_invalidate(fd_cache_key[fd % MAX_OPEN_FILES]);
     if (status == 0) {
         fd_set_file(fd, file);
         cmpl.data.file_open.fd = fd;
@@ -373,7 +493,11 @@ void handle_open(fs_cmd_t cmd) {
         posix_flags |= O_CREAT;
     }
 
-    err = nfs_open2_async(nfs, path, posix_flags, 0644, open_cb, cont);
+    // Close-to-open consistency, stats after an open go to the server again
+    fd_cache_key[fd % MAX_OPEN_FILES] = attr_cache_key(path);
+    attr_cache_invalidate(fd_cache_key[fd % MAX_OPEN_FILES]);
+
+    err = nfs_open2_async(nfs_for_fd(fd), path, posix_flags, 0644, open_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -395,6 +519,7 @@ void close_cb(int status, struct nfs_context *nfs, void *data, void *private_dat
     fd_t fd = cont->data[0];
     struct nfsfh *fh = (struct nfsfh *)cont->data[1];
 
+    attr_cache_invalidate(fd_cache_key[fd % MAX_OPEN_FILES]);
     if (status == 0) {
         fd_free(fd);
     } else {
@@ -432,7 +557,7 @@ void handle_close(fs_cmd_t cmd) {
     cont->data[0] = params.fd;
     cont->data[1] = (uint64_t)file_handle;
 
-    err = nfs_close_async(nfs, file_handle, close_cb, cont);
+    err = nfs_close_async(nfs_for_fd(params.fd), file_handle, close_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -490,7 +615,7 @@ void handle_read(fs_cmd_t cmd) {
     cont->data[0] = params.fd;
     cont->data[1] = (uint64_t)buf;
 
-    err = nfs_pread_async(nfs, file_handle, buf, params.buf.size, params.offset, read_cb, cont);
+    err = nfs_pread_async(nfs_for_fd(params.fd), file_handle, buf, params.buf.size, params.offset, read_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -511,6 +636,7 @@ void write_cb(int status, struct nfs_context *nfs, void *data, void *private_dat
     fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
     fd_t fd = cont->data[0];
 
+    attr_cache_invalidate(fd_cache_key[fd % MAX_OPEN_FILES]);
     if (status >= 0) {
         cmpl.data.file_write.len_written = status;
     } else {
@@ -547,7 +673,203 @@ void handle_write(fs_cmd_t cmd) {
     cont->request_id = cmd.id;
     cont->data[0] = params.fd;
 
-    err = nfs_pwrite_async(nfs, file_handle, buf, params.buf.size, params.offset, write_cb, cont);
+    err = nfs_pwrite_async(nfs_for_fd(params.fd), file_handle, buf, params.buf.size, params.offset, write_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        goto fail_enqueue;
+    }
+
+    return;
+
+fail_enqueue:
+    continuation_free(cont);
+    fd_end_op(params.fd);
+fail_begin:
+fail_buffer:
+    reply((fs_cmpl_t){ .id = cmd.id, .status = status, .data = {0} });
+}
+
+/*
+ * Vectored reads and writes are issued one buffer at a time, with each
+ * callback issuing the request for the next buffer. The callbacks only use the
+ * copy of the iovec array made by copy_iov, which is released with the request.
+ */
+void readv_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
+    struct continuation *cont = private_data;
+    fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
+    fd_t fd = cont->data[0];
+    struct nfsfh *file_handle = (struct nfsfh *)cont->data[1];
+    fs_buffer_t *iov = (fs_buffer_t *)cont->data[2];
+    uint64_t iovcnt = cont->data[3];
+    uint64_t i = cont->data[4];
+
+    if (status < 0) {
+        dlog("failed to read file: %d (%s)", status, data);
+        cmpl.status = FS_STATUS_ERROR;
+        goto done;
+    }
+
+    cont->data[5] += status;
+    cont->data[6] += status;
+    cont->data[4] = ++i;
+    if ((uint64_t)status < iov[i - 1].size || i == iovcnt) {
+        goto done;
+    }
+
+    char *buf = get_buffer(iov[i]);
+    int err = nfs_pread_async(nfs, file_handle, buf, iov[i].size, cont->data[5], readv_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        cmpl.status = FS_STATUS_ERROR;
+        goto done;
+    }
+
+    return;
+
+done:
+    cmpl.data.file_readv.len_read = cont->data[6];
+    iov_free(iov);
+    fd_end_op(fd);
+    continuation_free(cont);
+    reply(cmpl);
+}
+
+void handle_readv(fs_cmd_t cmd) {
+    uint64_t status = FS_STATUS_ERROR;
+    fs_cmd_params_file_readv_t params = cmd.params.file_readv;
+
+    fs_buffer_t *iov = iov_alloc();
+    if (iov == NULL) {
+        dlog("no free iovec buffers");
+        status = FS_STATUS_ALLOCATION_ERROR;
+        goto fail_alloc;
+    }
+
+    uint64_t iovcnt;
+    int err = copy_iov(iov, params.iov, &iovcnt);
+    if (err) {
+        dlog("invalid iovec provided");
+        status = FS_STATUS_INVALID_BUFFER;
+        goto fail_buffer;
+    }
+
+    struct nfsfh *file_handle = NULL;
+    err = fd_begin_op_file(params.fd, &file_handle);
+    if (err) {
+        dlog("invalid fd: %d", params.fd);
+        status = FS_STATUS_INVALID_FD;
+        goto fail_begin;
+    }
+
+    struct continuation *cont = continuation_alloc();
+    assert(cont != NULL);
+    cont->request_id = cmd.id;
+    cont->data[0] = params.fd;
+    cont->data[1] = (uint64_t)file_handle;
+    cont->data[2] = (uint64_t)iov;
+    cont->data[3] = iovcnt;
+    cont->data[4] = 0;
+    cont->data[5] = params.offset;
+    cont->data[6] = 0;
+
+    err = nfs_pread_async(nfs_for_fd(params.fd), file_handle, get_buffer(iov[0]), iov[0].size, params.offset, readv_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        goto fail_enqueue;
+    }
+
+    return;
+
+fail_enqueue:
+    continuation_free(cont);
+    fd_end_op(params.fd);
+fail_begin:
+fail_buffer:
+    iov_free(iov);
+fail_alloc:
+    reply((fs_cmpl_t){ .id = cmd.id, .status = status, .data = {0} });
+}
+
+void writev_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
+    struct continuation *cont = private_data;
+    fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
+    fd_t fd = cont->data[0];
+    struct nfsfh *file_handle = (struct nfsfh *)cont->data[1];
+    fs_buffer_t *iov = (fs_buffer_t *)cont->data[2];
+    uint64_t iovcnt = cont->data[3];
+    uint64_t i = cont->data[4];
+
+    if (status < 0) {
+        dlog("failed to write to file: %d (%s)", status, data);
+        cmpl.status = FS_STATUS_ERROR;
+        goto done;
+    }
+
+    cont->data[5] += status;
+    cont->data[6] += status;
+    cont->data[4] = ++i;
+    if ((uint64_t)status < iov[i - 1].size || i == iovcnt) {
+        goto done;
+    }
+
+    char *buf = get_buffer(iov[i]);
+    int err = nfs_pwrite_async(nfs, file_handle, buf, iov[i].size, cont->data[5], writev_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        cmpl.status = FS_STATUS_ERROR;
+        goto done;
+    }
+
+    return;
+
+done:
+    attr_cache_invalidate(fd_cache_key[fd % MAX_OPEN_FILES]);
+    cmpl.data.file_writev.len_written = cont->data[6];
+    iov_free(iov);
+    fd_end_op(fd);
+    continuation_free(cont);
+    reply(cmpl);
+}
+
+void handle_writev(fs_cmd_t cmd) {
+    uint64_t status = FS_STATUS_ERROR;
+    fs_cmd_params_file_writev_t params = cmd.params.file_writev;
+
+    fs_buffer_t *iov = iov_alloc();
+    if (iov == NULL) {
+        dlog("no free iovec buffers");
+        status = FS_STATUS_ALLOCATION_ERROR;
+        goto fail_alloc;
+    }
+
+    uint64_t iovcnt;
+    int err = copy_iov(iov, params.iov, &iovcnt);
+    if (err) {
+        dlog("invalid iovec provided");
+        status = FS_STATUS_INVALID_BUFFER;
+        goto fail_buffer;
+    }
+
+    struct nfsfh *file_handle = NULL;
+    err = fd_begin_op_file(params.fd, &file_handle);
+    if (err) {
+        dlog("invalid fd: %d", params.fd);
+        status = FS_STATUS_INVALID_FD;
+        goto fail_begin;
+    }
+
+    struct continuation *cont = continuation_alloc();
+    assert(cont != NULL);
+    cont->request_id = cmd.id;
+    cont->data[0] = params.fd;
+    cont->data[1] = (uint64_t)file_handle;
+    cont->data[2] = (uint64_t)iov;
+    cont->data[3] = iovcnt;
+    cont->data[4] = 0;
+    cont->data[5] = params.offset;
+    cont->data[6] = 0;
+
+    err = nfs_pwrite_async(nfs_for_fd(params.fd), file_handle, get_buffer(iov[0]), iov[0].size, params.offset, writev_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -559,6 +881,152 @@ fail_enqueue:
     continuation_free(cont);
     fd_end_op(params.fd);
 fail_begin:
+fail_buffer:
+    iov_free(iov);
+fail_alloc:
+    reply((fs_cmpl_t){ .id = cmd.id, .status = status, .data = {0} });
+}
+
+/*
+ * A fetch is carried out as open -> fstat -> pread -> close, with each callback
+ * issuing the next step. The path is only needed by the first step, so nothing
+ * has to be kept around from the path buffer. Once the file is open every
+ * exit goes through fetch_close so the file handle is never leaked.
+ */
+static void fetch_close(struct nfs_context *nfs, struct continuation *cont, uint64_t status);
+
+static void fetch_close_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
+    struct continuation *cont = private_data;
+    fs_cmpl_t cmpl = { .id = cont->request_id, .status = cont->data[5], .data = {0} };
+
+    if (status != 0) {
+        dlog("failed to close file: %d (%s)", status, nfs_get_error(nfs));
+    }
+    cmpl.data.file_fetch.len_read = cont->data[4];
+    continuation_free(cont);
+    reply(cmpl);
+}
+
+static void fetch_close(struct nfs_context *nfs, struct continuation *cont, uint64_t status) {
+    struct nfsfh *file_handle = (struct nfsfh *)cont->data[3];
+    cont->data[5] = status;
+
+    int err = nfs_close_async(nfs, file_handle, fetch_close_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        fs_cmpl_t cmpl = { .id = cont->request_id, .status = status, .data = {0} };
+        cmpl.data.file_fetch.len_read = cont->data[4];
+        continuation_free(cont);
+        reply(cmpl);
+    }
+}
+
+static void fetch_read_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
+    struct continuation *cont = private_data;
+
+    if (status < 0) {
+        dlog("failed to read file: %d (%s)", status, data);
+        fetch_close(nfs, cont, FS_STATUS_ERROR);
+        return;
+    }
+    cont->data[4] = status;
+    fetch_close(nfs, cont, FS_STATUS_SUCCESS);
+}
+
+static void fetch_fstat_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
+    struct continuation *cont = private_data;
+    struct nfsfh *file_handle = (struct nfsfh *)cont->data[3];
+    void *stat_buf = (void *)cont->data[0];
+    void *buf = (void *)cont->data[1];
+    uint64_t size = cont->data[2];
+
+    if (status != 0) {
+        dlog("failed to fstat file (%d): %s", status, data);
+        attr_cache_fill(cont->data[6], status, NULL);
+        fetch_close(nfs, cont, FS_STATUS_ERROR);
+        return;
+    }
+
+    struct nfs_stat_64 *st = data;
+    memcpy(stat_buf, st, sizeof (fs_stat_t));
+    attr_cache_fill(cont->data[6], status, stat_buf);
+    if (S_ISDIR(st->nfs_mode)) {
+        fetch_close(nfs, cont, FS_STATUS_SUCCESS);
+        return;
+    }
+
+    int err = nfs_pread_async(nfs, file_handle, buf, size, 0, fetch_read_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        fetch_close(nfs, cont, FS_STATUS_ERROR);
+    }
+}
+
+static void fetch_open_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
+    struct continuation *cont = private_data;
+    fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_ERROR, .data = {0} };
+    struct nfsfh *file_handle = data;
+
+    if (status != 0) {
+        dlogp(status != -ENOENT, "failed to open file (%d): %s", status, data);
+        attr_cache_fill(cont->data[6], status, NULL);
+        goto fail;
+    }
+    cont->data[3] = (uint64_t)file_handle;
+
+    int err = nfs_fstat64_async(nfs, file_handle, fetch_fstat_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        fetch_close(nfs, cont, FS_STATUS_ERROR);
+    }
+    return;
+
+fail:
+    continuation_free(cont);
+    reply(cmpl);
+}
+
+void handle_fetch(fs_cmd_t cmd) {
+    uint64_t status = FS_STATUS_ERROR;
+    fs_cmd_params_file_fetch_t params = cmd.params.file_fetch;
+
+    char *path = copy_path(0, params.path);
+    if (path == NULL) {
+        dlog("invalid path buffer provided");
+        status = FS_STATUS_INVALID_PATH;
+        goto fail_buffer;
+    }
+
+    void *stat_buf = get_buffer(params.stat);
+    char *buf = get_buffer(params.buf);
+    if (stat_buf == NULL || params.stat.size < sizeof (fs_stat_t) || buf == NULL) {
+        dlog("invalid output buffer provided");
+        status = FS_STATUS_INVALID_BUFFER;
+        goto fail_buffer;
+    }
+
+    struct continuation *cont = continuation_alloc();
+    assert(cont != NULL);
+    cont->request_id = cmd.id;
+    cont->data[0] = (uint64_t)stat_buf;
+    cont->data[1] = (uint64_t)buf;
+    cont->data[2] = params.buf.size;
+    cont->data[3] = 0;
+    cont->data[4] = 0;
+    cont->data[5] = FS_STATUS_ERROR;
+    // The fetch opens the file, so its attributes are refreshed from the fstat
+    cont->data[6] = attr_cache_begin(path);
+
+    int err = nfs_open2_async(nfs_next(), path, O_RDONLY, 0, fetch_open_cb, cont);
+    if (err) {
+        dlog("failed to enqueue command");
+        goto fail_enqueue;
+    }
+
+    return;
+
+fail_enqueue:
+    continuation_free(cont);
 fail_buffer:
     reply((fs_cmpl_t){ .id = cmd.id, .status = status, .data = {0} });
 }
@@ -566,6 +1034,8 @@ fail_buffer:
 void rename_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
     struct continuation *cont = private_data;
     fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
+    // Either path may be a directory, which changes every path beneath it
+    attr_cache_invalidate_all();
     if (status != 0) {
         dlog("failed to write to file: %d (%s)", status, data);
         cmpl.status = FS_STATUS_ERROR;
@@ -589,7 +1059,7 @@ void handle_rename(fs_cmd_t cmd) {
     struct continuation *cont = continuation_alloc();
     assert(cont != NULL);
     cont->request_id = cmd.id;
-    int err = nfs_rename_async(nfs, old_path, new_path, rename_cb, cont);
+    int err = nfs_rename_async(nfs_next(), old_path, new_path, rename_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -606,6 +1076,7 @@ fail_buffer:
 void unlink_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
     struct continuation *cont = private_data;
     fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
+    attr_cache_invalidate(cont->data[0]);
     if (status != 0) {
         dlog("failed to unlink file");
         cmpl.status = FS_STATUS_ERROR;
@@ -628,7 +1099,8 @@ void handle_unlink(fs_cmd_t cmd) {
     struct continuation *cont = continuation_alloc();
     assert(cont != NULL);
     cont->request_id = cmd.id;
-    int err = nfs_unlink_async(nfs, path, unlink_cb, cont);
+    cont->data[0] = attr_cache_key(path);
+    int err = nfs_unlink_async(nfs_next(), path, unlink_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -672,7 +1144,7 @@ void handle_fsync(fs_cmd_t cmd) {
     cont->request_id = cmd.id;
     cont->data[0] = params.fd;
 
-    err = nfs_fsync_async(nfs, file_handle, fsync_cb, cont);
+    err = nfs_fsync_async(nfs_for_fd(params.fd), file_handle, fsync_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -691,6 +1163,7 @@ void truncate_cb(int status, struct nfs_context *nfs, void *data, void *private_
     struct continuation *cont = private_data;
     fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
     fd_t fd = cont->data[0];
+    attr_cache_invalidate(fd_cache_key[fd % MAX_OPEN_FILES]);
     if (status != 0) {
         dlog("ftruncate failed: %d (%s)", status, data);
         cmpl.status = FS_STATUS_ERROR;
@@ -717,7 +1190,7 @@ void handle_truncate(fs_cmd_t cmd) {
     cont->request_id = cmd.id;
     cont->data[0] = params.fd;
 
-    err = nfs_ftruncate_async(nfs, file_handle, params.length, truncate_cb, cont);
+    err = nfs_ftruncate_async(nfs_for_fd(params.fd), file_handle, params.length, truncate_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -732,9 +1205,15 @@ fail_begin:
     reply((fs_cmpl_t){ .id = cmd.id, .status = status, .data = {0} });
 }
 
+void handle_allocate(fs_cmd_t cmd) {
+    // NFSv3 has no way to reserve space for a file ahead of writing it
+    reply((fs_cmpl_t){ .id = cmd.id, .status = FS_STATUS_INVALID_COMMAND, .data = {0} });
+}
+
 void mkdir_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
     struct continuation *cont = private_data;
     fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
+    attr_cache_invalidate(cont->data[0]);
     if (status != 0) {
         dlog("failed to write to file: %d (%s)", status, data);
         cmpl.status = FS_STATUS_ERROR;
@@ -757,8 +1236,9 @@ void handle_mkdir(fs_cmd_t cmd) {
     struct continuation *cont = continuation_alloc();
     assert(cont != NULL);
     cont->request_id = cmd.id;
+    cont->data[0] = attr_cache_key(path);
 
-    int err = nfs_mkdir_async(nfs, path, mkdir_cb, cont);
+    int err = nfs_mkdir_async(nfs_next(), path, mkdir_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -773,8 +1253,9 @@ fail_buffer:
 }
 
 void rmdir_cb(int status, struct nfs_context *nfs, void *data, void *private_data) {
-    struct continuation *cont = continuation_alloc();
+    struct continuation *cont = private_data;
     fs_cmpl_t cmpl = { .id = cont->request_id, .status = FS_STATUS_SUCCESS, .data = {0} };
+    attr_cache_invalidate(cont->data[0]);
     if (status != 0) {
         dlog("failed to write to file: %d (%s)", status, data);
         cmpl.status = FS_STATUS_ERROR;
@@ -797,8 +1278,9 @@ void handle_rmdir(fs_cmd_t cmd) {
     struct continuation *cont = continuation_alloc();
     assert(cont != NULL);
     cont->request_id = cmd.id;
+    cont->data[0] = attr_cache_key(path);
 
-    int err = nfs_rmdir_async(nfs, path, rmdir_cb, cont);
+    int err = nfs_rmdir_async(nfs_next(), path, rmdir_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         goto fail_enqueue;
@@ -856,7 +1338,8 @@ void handle_opendir(fs_cmd_t cmd) {
     cont->request_id = cmd.id;
     cont->data[0] = fd;
 
-    err = nfs_opendir_async(nfs, path, opendir_cb, cont);
+    attr_cache_invalidate(attr_cache_key(path));
+    err = nfs_opendir_async(nfs_for_fd(fd), path, opendir_cb, cont);
     if (err) {
         dlog("failed to enqueue command");
         cmpl.status = FS_STATUS_ERROR;
@@ -893,7 +1376,7 @@ void handle_closedir(fs_cmd_t cmd) {
         goto fail;
     }
 
-    nfs_closedir(nfs, dir_handle);
+    nfs_closedir(nfs_for_fd(params.fd), dir_handle);
     fd_free(params.fd);
 fail:
     reply(cmpl);
@@ -918,7 +1401,7 @@ void handle_readdir(fs_cmd_t cmd) {
         goto fail_begin;
     }
 
-    struct nfsdirent *dirent = nfs_readdir(nfs, dir_handle);
+    struct nfsdirent *dirent = nfs_readdir(nfs_for_fd(params.fd), dir_handle);
     if (dirent == NULL) {
         cmpl.status = FS_STATUS_END_OF_DIRECTORY;
         goto end_of_dir;
@@ -936,6 +1419,82 @@ fail_buffer:
     reply(cmpl);
 }
 
+/* The directory was read in full by nfs_opendir, so this never has to wait on the server */
+void handle_readdir_batch(fs_cmd_t cmd) {
+    fs_cmd_params_dir_read_batch_t params = cmd.params.dir_read_batch;
+    fs_cmpl_t cmpl = { .id = cmd.id, .status = FS_STATUS_SUCCESS, .data = {0} };
+
+    char *buf = get_buffer(params.buf);
+    if (buf == NULL || params.buf.size < FS_DIRENT_SIZE(FS_MAX_NAME_LENGTH)) {
+        dlog("invalid output buffer provided");
+        cmpl.status = FS_STATUS_INVALID_BUFFER;
+        goto fail_buffer;
+    }
+
+    struct nfsdir *dir_handle = NULL;
+    int err = fd_begin_op_dir(params.fd, &dir_handle);
+    if (err) {
+        dlog("invalid fd (%d)", params.fd);
+        cmpl.status = FS_STATUS_INVALID_FD;
+        goto fail_begin;
+    }
+
+    uint64_t used = 0;
+    uint64_t count = 0;
+    for (;;) {
+        long loc = nfs_telldir(nfs_for_fd(params.fd), dir_handle);
+        struct nfsdirent *dirent = nfs_readdir(nfs_for_fd(params.fd), dir_handle);
+        if (dirent == NULL) {
+            break;
+        }
+
+        uint64_t name_len = strlen(dirent->name);
+        assert(name_len <= FS_MAX_NAME_LENGTH);
+        if (used + FS_DIRENT_SIZE(name_len) > params.buf.size) {
+            nfs_seekdir(nfs_for_fd(params.fd), dir_handle, loc);
+            break;
+        }
+
+        fs_dirent_t entry = {
+            .stat = {
+                .dev = dirent->dev,
+                .ino = dirent->inode,
+                .mode = dirent->mode,
+                .nlink = dirent->nlink,
+                .uid = dirent->uid,
+                .gid = dirent->gid,
+                .rdev = dirent->rdev,
+                .size = dirent->size,
+                .blksize = dirent->blksize,
+                .blocks = dirent->blocks,
+                .atime = dirent->atime.tv_sec,
+                .mtime = dirent->mtime.tv_sec,
+                .ctime = dirent->ctime.tv_sec,
+                .atime_nsec = dirent->atime_nsec,
+                .mtime_nsec = dirent->mtime_nsec,
+                .ctime_nsec = dirent->ctime_nsec,
+                .used = dirent->used,
+            },
+            .name_len = name_len,
+        };
+        memcpy(buf + used, &entry, sizeof (fs_dirent_t));
+        memcpy(buf + used + sizeof (fs_dirent_t), dirent->name, name_len);
+        used += FS_DIRENT_SIZE(name_len);
+        count++;
+    }
+
+    cmpl.data.dir_read_batch.num_entries = count;
+    cmpl.data.dir_read_batch.cookie = nfs_telldir(nfs_for_fd(params.fd), dir_handle);
+    if (count == 0) {
+        cmpl.status = FS_STATUS_END_OF_DIRECTORY;
+    }
+
+    fd_end_op(params.fd);
+fail_begin:
+fail_buffer:
+    reply(cmpl);
+}
+
 void handle_seekdir(fs_cmd_t cmd) {
     fs_cmd_params_dir_seek_t params = cmd.params.dir_seek;
     fs_cmpl_t cmpl = { .id = cmd.id, .status = FS_STATUS_SUCCESS, .data = {0} };
@@ -947,7 +1506,7 @@ void handle_seekdir(fs_cmd_t cmd) {
         cmpl.status = FS_STATUS_INVALID_FD;
         goto fail;
     }
-    nfs_seekdir(nfs, dir_handle, params.loc);
+    nfs_seekdir(nfs_for_fd(params.fd), dir_handle, params.loc);
     fd_end_op(params.fd);
 
 fail:
@@ -965,7 +1524,7 @@ void handle_telldir(fs_cmd_t cmd) {
         cmpl.status = FS_STATUS_INVALID_FD;
         goto fail;
     }
-    cmpl.data.dir_tell.location = nfs_telldir(nfs, dir_handle);
+    cmpl.data.dir_tell.location = nfs_telldir(nfs_for_fd(params.fd), dir_handle);
     fd_end_op(params.fd);
 
 fail:
@@ -983,7 +1542,7 @@ void handle_rewinddir(fs_cmd_t cmd) {
         cmpl.status = FS_STATUS_INVALID_FD;
         goto fail;
     }
-    nfs_rewinddir(nfs, dir_handle);
+    nfs_rewinddir(nfs_for_fd(params.fd), dir_handle);
     fd_end_op(params.fd);
 
 fail:
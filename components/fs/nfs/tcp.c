@@ -62,9 +62,20 @@ typedef struct {
     struct tcp_pcb *sock_tpcb;
     enum socket_state state;
 
-    char rx_buf[SOCKET_BUF_SIZE];
-    ssize_t rx_head;
+    /*
+     * Received data not yet read, as the pbufs lwIP handed over linked in the order they arrived.
+     * They refer to the sDDF RX buffers, so nothing is copied until tcp_socket_recv, and each
+     * buffer goes back to the driver as soon as it has been read.
+     */
+    struct pbuf *rx_head;
+    struct pbuf *rx_tail;
+    // Bytes of rx_head already read
+    u16_t rx_offset;
     ssize_t rx_len;
+
+    // Sequence number following the last data sent from the client share without copying it
+    u32_t zc_seq_end;
+    bool zc_used;
 } socket_t;
 
 state_t state;
@@ -239,6 +250,12 @@ void tcp_update(void)
     sys_check_timeouts();
 }
 
+uint32_t tcp_next_timeout(void)
+{
+    u32_t sleep_ms = sys_timeouts_sleeptime();
+    return (sleep_ms == SYS_TIMEOUTS_SLEEPTIME_INFINITE) ? UINT32_MAX : sleep_ms;
+}
+
 void tcp_init_0(void)
 {
     size_t rx_capacity, tx_capacity;
@@ -293,6 +310,16 @@ int socket_id(socket_t *socket) {
     return (int)(socket - sockets);
 }
 
+static void socket_rx_reset(socket_t *socket) {
+    if (socket->rx_head != NULL) {
+        pbuf_free(socket->rx_head);
+    }
+    socket->rx_head = NULL;
+    socket->rx_tail = NULL;
+    socket->rx_offset = 0;
+    socket->rx_len = 0;
+}
+
 void socket_err_func(void *arg, err_t err)
 {
     socket_t *socket = arg;
@@ -317,21 +344,18 @@ static err_t socket_recv_callback(void *arg, struct tcp_pcb *tpcb, struct pbuf *
 
     case socket_state_connected: {
         if (p != NULL) {
-            int capacity = SOCKET_BUF_SIZE - socket->rx_len;
-            if (capacity < p->tot_len) {
-                return ERR_MEM;
+            // The links between pbufs are what matter here, tot_len is only right within each chain
+            if (socket->rx_head == NULL) {
+                socket->rx_head = p;
+            } else {
+                socket->rx_tail->next = p;
             }
-
-            int copied = 0, remaining = p->tot_len;
-            while (remaining != 0) {
-                int rx_tail = (socket->rx_head + socket->rx_len) % SOCKET_BUF_SIZE;
-                int to_copy = MIN(remaining, SOCKET_BUF_SIZE - MAX(socket->rx_len, rx_tail));
-                pbuf_copy_partial(p, socket->rx_buf + rx_tail, to_copy, copied);
-                socket->rx_len += to_copy;
-                copied += to_copy;
-                remaining -= to_copy;
-            }        
-            pbuf_free(p);
+            socket->rx_len += p->tot_len;
+            struct pbuf *last = p;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            socket->rx_tail = last;
         } else {
             socket->state = socket_state_closed_by_peer;
             tcp_close(tpcb);
@@ -347,8 +371,8 @@ static err_t socket_recv_callback(void *arg, struct tcp_pcb *tpcb, struct pbuf *
             tcp_arg(socket->sock_tpcb, NULL);
             socket->state = socket_state_unallocated;
             socket->sock_tpcb = NULL;
-            socket->rx_head = 0;
-            socket->rx_len = 0;
+            socket->zc_used = false;
+            socket_rx_reset(socket);
         }
         return ERR_OK;
     }
@@ -398,7 +422,7 @@ int tcp_socket_create(void) {
     }
 
     assert(socket->sock_tpcb == NULL);
-    assert(socket->rx_head == 0);
+    assert(socket->rx_head == NULL);
     assert(socket->rx_len == 0);
 
     socket->sock_tpcb = tcp_new_ip_type(IPADDR_TYPE_V4);
@@ -446,6 +470,20 @@ int tcp_socket_close(int index)
     switch (socket->state) {
 
     case socket_state_connected: {
+        /*
+         * Once an RPC has failed the client is free to reuse its buffer, so lwIP must not retransmit
+         * data it sent from the client share after the socket has been given up. If any of it has not
+         * been acknowledged the connection is reset rather than closed.
+         */
+        if (socket->zc_used && (s32_t)(socket->sock_tpcb->lastack - socket->zc_seq_end) < 0) {
+            tcp_arg(socket->sock_tpcb, NULL);
+            tcp_abort(socket->sock_tpcb);
+            socket->state = socket_state_unallocated;
+            socket->sock_tpcb = NULL;
+            socket->zc_used = false;
+            socket_rx_reset(socket);
+            return 0;
+        }
         socket->state = socket_state_closing;
         int err = tcp_close(socket->sock_tpcb);
         dlogp(err != ERR_OK, "error closing socket (%d)", err);
@@ -457,8 +495,8 @@ int tcp_socket_close(int index)
     case socket_state_closed_by_peer: {
         socket->state = socket_state_unallocated;
         socket->sock_tpcb = NULL;
-        socket->rx_head = 0;
-        socket->rx_len = 0;
+        socket->zc_used = false;
+        socket_rx_reset(socket);
 
         return 0;
     }
@@ -479,7 +517,13 @@ int tcp_socket_write(int index, const char *buf, size_t len) {
         return -2;
     }
     int to_write = MIN(len, available);
-    int err = tcp_write(sock->sock_tpcb, (void *)buf, to_write, 1);
+    /*
+     * WRITE payloads are passed through by libnfs as pointers into the client share, which is only
+     * given back to the client when the reply to the RPC arrives. The server has acknowledged all of
+     * the RPC by then, so lwIP can send the payload from where it is rather than copying it.
+     */
+    u8_t flags = in_client_share(buf, to_write) ? 0 : TCP_WRITE_FLAG_COPY;
+    int err = tcp_write(sock->sock_tpcb, (void *)buf, to_write, flags);
     if (err == ERR_MEM) {
         dlog("tcp_write returned ERR_MEM");
         return -2;
@@ -487,6 +531,10 @@ int tcp_socket_write(int index, const char *buf, size_t len) {
         dlog("tcp_write failed (%d)", err);
         return -1;
     }
+    if (!(flags & TCP_WRITE_FLAG_COPY)) {
+        sock->zc_seq_end = sock->sock_tpcb->snd_lbb;
+        sock->zc_used = true;
+    }
     err = tcp_output(sock->sock_tpcb);
     if (err != ERR_OK) {
         dlog("tcp_output failed (%d)", err);
@@ -501,17 +549,29 @@ ssize_t tcp_socket_recv(int index, char *buf, ssize_t len) {
         return -1;
     }
     ssize_t copied = 0;
-    while (copied != len) {
-        ssize_t to_copy = MIN(len - copied, MIN(sock->rx_len, SOCKET_BUF_SIZE - sock->rx_head));
-        if (to_copy == 0) {
-            break;
-        }
-        memcpy(buf + copied, sock->rx_buf + sock->rx_head, to_copy);
-        sock->rx_head = (sock->rx_head + to_copy) % SOCKET_BUF_SIZE;
-        sock->rx_len -= to_copy;
+    while (copied != len && sock->rx_head != NULL) {
+        struct pbuf *q = sock->rx_head;
+        ssize_t to_copy = MIN(len - copied, q->len - sock->rx_offset);
+        memcpy(buf + copied, (char *)q->payload + sock->rx_offset, to_copy);
+        sock->rx_offset += to_copy;
         copied += to_copy;
+        if (sock->rx_offset == q->len) {
+            // Keep the rest of the queue alive while freeing the pbuf that has been read
+            sock->rx_head = q->next;
+            if (q->next != NULL) {
+                pbuf_ref(q->next);
+            } else {
+                sock->rx_tail = NULL;
+            }
+            pbuf_free(q);
+            sock->rx_offset = 0;
+        }
+    }
+    sock->rx_len -= copied;
+    // Open the window again by what was read, tcp_recved takes at most UINT16_MAX bytes at a time
+    for (ssize_t acked = 0; acked < copied; acked += UINT16_MAX) {
+        tcp_recved(sock->sock_tpcb, MIN(copied - acked, UINT16_MAX));
     }
-    tcp_recved(sock->sock_tpcb, copied);
     return copied;
 }
 
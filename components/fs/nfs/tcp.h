@@ -7,12 +7,16 @@
 
 #include <stdint.h>
 
-#define SOCKET_BUF_SIZE 0x200000ll
-#define MAX_SOCKETS 3
+#include "nfs.h"
+
+// A few sockets per connection to the NFS server, to survive reconnects
+#define MAX_SOCKETS (NFS_CONNECTIONS * 3)
 
 void tcp_init_0(void);
 int tcp_ready(void);
 void tcp_update(void);
+// Milliseconds until tcp_update next has work to do, UINT32_MAX if lwIP has no timeouts pending
+uint32_t tcp_next_timeout(void);
 void tcp_process_rx(void);
 void tcp_maybe_notify(void);
 
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <lions/fs/protocol.h>
+
+// Flag to control whether enabling debug printing
+// #define FS_VIRT_DEBUG_PRINT
+
+// Number of clients multiplexed onto the file system server
+#ifndef FS_VIRT_NUM_CLIENTS
+#define FS_VIRT_NUM_CLIENTS 2
+#endif
+
+// Size of the data region shared between each client and the virtualiser. The server maps the
+// region of client i at offset i * FS_VIRT_CLIENT_SHARE_SIZE of its own data region, followed by
+// the scratch region, so the server's data region must be at least FS_VIRT_SERVER_DATA_REGION_SIZE.
+#define FS_VIRT_CLIENT_SHARE_SIZE 0x4000000
+
+// Distance between the queues of consecutive clients in the virtualiser's address space
+#define FS_VIRT_QUEUE_REGION_SIZE 0x8000
+
+// Maximum number of commands a single client may have outstanding at the server
+#define FS_VIRT_CLIENT_CREDITS 64
+
+// Size of the fd ownership tables, must be at least the number of fds the server can hand out
+#define FS_VIRT_MAX_FDS 256
+
+// Translated iovec arrays are staged here, one slot per outstanding request
+#define FS_VIRT_IOV_SLOT_SIZE (FS_MAX_IOV * sizeof (fs_buffer_t))
+#define FS_VIRT_SCRATCH_SIZE (FS_QUEUE_CAPACITY * FS_VIRT_IOV_SLOT_SIZE)
+
+#define FS_VIRT_SERVER_DATA_REGION_SIZE (FS_VIRT_NUM_CLIENTS * FS_VIRT_CLIENT_SHARE_SIZE + FS_VIRT_SCRATCH_SIZE)
+
+#define FS_VIRT_SERVER_CH 0
+// Client i is connected on channel FS_VIRT_CLIENT_CH_BASE + i
+#define FS_VIRT_CLIENT_CH_BASE 1
+
+_Static_assert(FS_VIRT_NUM_CLIENTS * FS_VIRT_CLIENT_CREDITS <= FS_QUEUE_CAPACITY,
+               "outstanding requests of all clients must fit in the server queues");
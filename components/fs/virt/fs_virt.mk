@@ -0,0 +1,39 @@
+#
+# Copyright 2024, UNSW
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# This Makefile snippet builds the file system virtualiser component
+# it should be included into your project Makefile
+#
+# NOTES:
+# Generates fs_virt.elf
+# Requires ${SDDF}/util/util.mk to build the utility library for debug output
+# FS_VIRT_NUM_CLIENTS may be defined to set the number of clients (default 2)
+
+FS_VIRT_DIR := $(LIONSOS)/components/fs/virt
+
+CFLAGS_fs_virt := \
+	-I$(LIONSOS)/include \
+	-I$(FS_VIRT_DIR)/config
+
+ifdef FS_VIRT_NUM_CLIENTS
+	CFLAGS_fs_virt += -DFS_VIRT_NUM_CLIENTS=$(FS_VIRT_NUM_CLIENTS)
+endif
+
+CHECK_FS_VIRT_FLAGS_MD5 := .fs_virt_cflags-$(shell echo -- $(CFLAGS) $(CFLAGS_fs_virt) | shasum | sed 's/ *-//')
+
+$(CHECK_FS_VIRT_FLAGS_MD5):
+	-rm -f .fs_virt_cflags-*
+	touch $@
+
+fs_virt/virt.o: $(FS_VIRT_DIR)/virt.c $(CHECK_FS_VIRT_FLAGS_MD5) |fs_virt
+	$(CC) -c $(CFLAGS) $(CFLAGS_fs_virt) $< -o $@
+
+fs_virt.elf: fs_virt/virt.o
+	$(LD) $(LDFLAGS) -o $@ $^ $(LIBS)
+
+fs_virt:
+	mkdir -p $@
+
+-include fs_virt/virt.d
@@ -0,0 +1,486 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * The file system virtualiser multiplexes the command/completion queues of several
+ * clients onto the single pair of queues served by a file system server (FAT or NFS).
+ *
+ * - Request ids are rewritten to an index into the request table, which remembers the
+ *   client and its original request id until the completion comes back.
+ * - Buffer offsets are relative to each client's shared data region. The server sees every
+ *   client region in one window, so offsets are bounds checked and moved by the position
+ *   of the client's region within that window. Vectored commands have their iovec array
+ *   translated into a scratch region owned by the virtualiser.
+ * - fds handed out by the server are recorded against the client that opened them, and a
+ *   client may only use fds it owns.
+ * - Each client may only have FS_VIRT_CLIENT_CREDITS commands outstanding, and clients are
+ *   served round robin one command at a time, so a client streaming large reads cannot
+ *   starve the others.
+ */
+
+#include <microkit.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <lions/fs/protocol.h>
+#include <fs_virt_config.h>
+
+#ifdef FS_VIRT_DEBUG_PRINT
+#include <sddf/util/printf.h>
+#define LOG_FS_VIRT(...) do{ sddf_dprintf("FS_VIRT|INFO: "); sddf_dprintf(__VA_ARGS__); } while(0)
+#else
+#define LOG_FS_VIRT(...) do{}while(0)
+#endif
+
+fs_queue_t *server_command_queue;
+fs_queue_t *server_completion_queue;
+
+// Client queues are mapped back to back, FS_VIRT_QUEUE_REGION_SIZE apart
+uintptr_t client_command_queues;
+uintptr_t client_completion_queues;
+
+// Client data regions are mapped back to back, FS_VIRT_CLIENT_SHARE_SIZE apart
+char *client_data_regions;
+
+// Mapped into the server after the client data regions
+char *scratch_region;
+
+typedef struct request {
+    uint64_t client;
+    uint64_t client_request_id;
+    uint64_t type;
+    // fd being closed, so ownership can be dropped once the server has closed it
+    uint64_t fd;
+    struct request *next_free;
+    bool in_use;
+} request_t;
+
+static request_t requests[FS_QUEUE_CAPACITY];
+static request_t *first_free_request;
+
+typedef struct fd_owner {
+    uint64_t fd;
+    uint64_t client;
+    bool in_use;
+} fd_owner_t;
+
+// Files and directories are kept apart as the FAT server numbers them independently
+static fd_owner_t file_owners[FS_VIRT_MAX_FDS];
+static fd_owner_t dir_owners[FS_VIRT_MAX_FDS];
+
+static uint64_t client_outstanding[FS_VIRT_NUM_CLIENTS];
+static bool client_notify[FS_VIRT_NUM_CLIENTS];
+static bool server_notify;
+
+// Client to be served first in the next round of scheduling
+static uint64_t next_client;
+
+// The server is mounted once on behalf of all clients
+static enum {
+    MOUNT_NONE,
+    MOUNT_IN_PROGRESS,
+    MOUNT_DONE,
+} mount_state;
+
+static inline fs_queue_t *client_command_queue(uint64_t client) {
+    return (fs_queue_t *)(client_command_queues + client * FS_VIRT_QUEUE_REGION_SIZE);
+}
+
+static inline fs_queue_t *client_completion_queue(uint64_t client) {
+    return (fs_queue_t *)(client_completion_queues + client * FS_VIRT_QUEUE_REGION_SIZE);
+}
+
+static request_t *request_alloc(void) {
+    request_t *req = first_free_request;
+    if (req != NULL) {
+        first_free_request = req->next_free;
+        req->next_free = NULL;
+        req->in_use = true;
+    }
+    return req;
+}
+
+static void request_free(request_t *req) {
+    req->in_use = false;
+    req->next_free = first_free_request;
+    first_free_request = req;
+}
+
+static void client_reply(uint64_t client, fs_cmpl_t cmpl) {
+    fs_queue_t *queue = client_completion_queue(client);
+    fs_queue_idx_empty(queue, 0)->cmpl = cmpl;
+    fs_queue_publish_production(queue, 1);
+    client_notify[client] = true;
+}
+
+// Move a buffer from the client's data region into the server's view of all data regions
+static bool translate_buffer(uint64_t client, fs_buffer_t *buf) {
+    if (buf->offset >= FS_VIRT_CLIENT_SHARE_SIZE || buf->size > FS_VIRT_CLIENT_SHARE_SIZE - buf->offset) {
+        return false;
+    }
+    buf->offset += client * FS_VIRT_CLIENT_SHARE_SIZE;
+    return true;
+}
+
+static bool translate_iov(uint64_t client, uint64_t slot, fs_buffer_t *iov) {
+    if (iov->offset >= FS_VIRT_CLIENT_SHARE_SIZE
+        || iov->size > FS_VIRT_CLIENT_SHARE_SIZE - iov->offset
+        || iov->size % sizeof (fs_buffer_t) != 0
+        || iov->size > FS_VIRT_IOV_SLOT_SIZE) {
+        return false;
+    }
+
+    fs_buffer_t *src = (fs_buffer_t *)(client_data_regions + client * FS_VIRT_CLIENT_SHARE_SIZE + iov->offset);
+    fs_buffer_t *dst = (fs_buffer_t *)(scratch_region + slot * FS_VIRT_IOV_SLOT_SIZE);
+    for (uint64_t i = 0; i < iov->size / sizeof (fs_buffer_t); i++) {
+        fs_buffer_t entry = src[i];
+        if (!translate_buffer(client, &entry)) {
+            return false;
+        }
+        dst[i] = entry;
+    }
+
+    iov->offset = FS_VIRT_NUM_CLIENTS * FS_VIRT_CLIENT_SHARE_SIZE + slot * FS_VIRT_IOV_SLOT_SIZE;
+    return true;
+}
+
+static bool owns_fd(fd_owner_t *table, uint64_t client, uint64_t fd) {
+    fd_owner_t *owner = &table[fd % FS_VIRT_MAX_FDS];
+    return owner->in_use && owner->fd == fd && owner->client == client;
+}
+
+static void set_fd_owner(fd_owner_t *table, uint64_t client, uint64_t fd) {
+    fd_owner_t *owner = &table[fd % FS_VIRT_MAX_FDS];
+    owner->fd = fd;
+    owner->client = client;
+    owner->in_use = true;
+}
+
+static void clear_fd_owner(fd_owner_t *table, uint64_t fd) {
+    table[fd % FS_VIRT_MAX_FDS].in_use = false;
+}
+
+/*
+ * Rewrite a client command into the form the server expects.
+ * Returns FS_STATUS_SUCCESS if the command should be forwarded,
+ * otherwise the status the client should be answered with.
+ */
+static uint64_t translate_command(uint64_t client, uint64_t slot, fs_cmd_t *cmd) {
+    fs_cmd_params_t *params = &cmd->params;
+
+    switch (cmd->type) {
+    case FS_CMD_FILE_OPEN:
+        if (!translate_buffer(client, &params->file_open.path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        break;
+    case FS_CMD_STAT:
+        if (!translate_buffer(client, &params->stat.path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        if (!translate_buffer(client, &params->stat.buf)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_RENAME:
+        if (!translate_buffer(client, &params->rename.old_path)
+            || !translate_buffer(client, &params->rename.new_path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        break;
+    case FS_CMD_FILE_REMOVE:
+        if (!translate_buffer(client, &params->file_remove.path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        break;
+    case FS_CMD_DIR_CREATE:
+        if (!translate_buffer(client, &params->dir_create.path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        break;
+    case FS_CMD_DIR_REMOVE:
+        if (!translate_buffer(client, &params->dir_remove.path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        break;
+    case FS_CMD_DIR_OPEN:
+        if (!translate_buffer(client, &params->dir_open.path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        break;
+    case FS_CMD_FILE_FETCH:
+        if (!translate_buffer(client, &params->file_fetch.path)) {
+            return FS_STATUS_INVALID_PATH;
+        }
+        if (!translate_buffer(client, &params->file_fetch.stat)
+            || !translate_buffer(client, &params->file_fetch.buf)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_FILE_CLOSE:
+        if (!owns_fd(file_owners, client, params->file_close.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_FILE_READ:
+        if (!owns_fd(file_owners, client, params->file_read.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        if (!translate_buffer(client, &params->file_read.buf)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_FILE_WRITE:
+        if (!owns_fd(file_owners, client, params->file_write.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        if (!translate_buffer(client, &params->file_write.buf)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_FILE_READV:
+        if (!owns_fd(file_owners, client, params->file_readv.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        if (!translate_iov(client, slot, &params->file_readv.iov)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_FILE_WRITEV:
+        if (!owns_fd(file_owners, client, params->file_writev.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        if (!translate_iov(client, slot, &params->file_writev.iov)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_FILE_SIZE:
+        if (!owns_fd(file_owners, client, params->file_size.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_FILE_TRUNCATE:
+        if (!owns_fd(file_owners, client, params->file_truncate.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_FILE_SYNC:
+        if (!owns_fd(file_owners, client, params->file_sync.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_FILE_ALLOCATE:
+        if (!owns_fd(file_owners, client, params->file_allocate.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_DIR_CLOSE:
+        if (!owns_fd(dir_owners, client, params->dir_close.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_DIR_READ:
+        if (!owns_fd(dir_owners, client, params->dir_read.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        if (!translate_buffer(client, &params->dir_read.buf)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_DIR_READ_BATCH:
+        if (!owns_fd(dir_owners, client, params->dir_read_batch.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        if (!translate_buffer(client, &params->dir_read_batch.buf)) {
+            return FS_STATUS_INVALID_BUFFER;
+        }
+        break;
+    case FS_CMD_DIR_SEEK:
+        if (!owns_fd(dir_owners, client, params->dir_seek.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_DIR_TELL:
+        if (!owns_fd(dir_owners, client, params->dir_tell.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    case FS_CMD_DIR_REWIND:
+        if (!owns_fd(dir_owners, client, params->dir_rewind.fd)) {
+            return FS_STATUS_INVALID_FD;
+        }
+        break;
+    default:
+        return FS_STATUS_INVALID_COMMAND;
+    }
+
+    return FS_STATUS_SUCCESS;
+}
+
+/*
+ * Handle the command at the head of a client's queue.
+ * Returns false if the command has to stay queued for now.
+ */
+static bool process_client_command(uint64_t client) {
+    fs_cmd_t cmd = fs_queue_idx_filled(client_command_queue(client), 0)->cmd;
+    fs_cmpl_t cmpl = { .id = cmd.id, .status = FS_STATUS_SUCCESS, .data = {0} };
+
+    switch (cmd.type) {
+    case FS_CMD_INITIALISE:
+        if (mount_state == MOUNT_DONE) {
+            client_reply(client, cmpl);
+            return true;
+        }
+        if (mount_state == MOUNT_IN_PROGRESS) {
+            // Answered once the outstanding mount completes
+            return false;
+        }
+        break;
+    case FS_CMD_DEINITIALISE:
+        // Other clients may still be using the file system, so it is never unmounted
+        client_reply(client, cmpl);
+        return true;
+    }
+
+    request_t *req = request_alloc();
+    if (req == NULL) {
+        return false;
+    }
+    uint64_t slot = req - requests;
+
+    uint64_t status = FS_STATUS_SUCCESS;
+    if (cmd.type != FS_CMD_INITIALISE) {
+        status = translate_command(client, slot, &cmd);
+    }
+    if (status != FS_STATUS_SUCCESS) {
+        LOG_FS_VIRT("rejecting command %lu from client %lu: %s\n", cmd.type, client, fs_status_to_str(status));
+        request_free(req);
+        cmpl.status = status;
+        client_reply(client, cmpl);
+        return true;
+    }
+
+    if (cmd.type == FS_CMD_INITIALISE) {
+        mount_state = MOUNT_IN_PROGRESS;
+    }
+
+    req->client = client;
+    req->client_request_id = cmd.id;
+    req->type = cmd.type;
+    if (cmd.type == FS_CMD_FILE_CLOSE) {
+        req->fd = cmd.params.file_close.fd;
+    } else if (cmd.type == FS_CMD_DIR_CLOSE) {
+        req->fd = cmd.params.dir_close.fd;
+    }
+    cmd.id = slot;
+
+    fs_queue_idx_empty(server_command_queue, 0)->cmd = cmd;
+    fs_queue_publish_production(server_command_queue, 1);
+    client_outstanding[client]++;
+    server_notify = true;
+    return true;
+}
+
+static bool client_can_issue(uint64_t client) {
+    if (fs_queue_length_consumer(client_command_queue(client)) == 0) {
+        return false;
+    }
+    if (client_outstanding[client] >= FS_VIRT_CLIENT_CREDITS) {
+        return false;
+    }
+    // Leave room for every outstanding command to be answered
+    return fs_queue_length_producer(client_completion_queue(client)) + client_outstanding[client] < FS_QUEUE_CAPACITY;
+}
+
+static void process_commands(void) {
+    bool progress = true;
+    while (progress && fs_queue_length_producer(server_command_queue) < FS_QUEUE_CAPACITY) {
+        progress = false;
+        for (uint64_t i = 0; i < FS_VIRT_NUM_CLIENTS; i++) {
+            if (fs_queue_length_producer(server_command_queue) == FS_QUEUE_CAPACITY) {
+                break;
+            }
+            uint64_t client = (next_client + i) % FS_VIRT_NUM_CLIENTS;
+            if (!client_can_issue(client)) {
+                continue;
+            }
+            if (process_client_command(client)) {
+                fs_queue_publish_consumption(client_command_queue(client), 1);
+                progress = true;
+            }
+        }
+    }
+    next_client = (next_client + 1) % FS_VIRT_NUM_CLIENTS;
+}
+
+static void process_completions(void) {
+    uint64_t count = fs_queue_length_consumer(server_completion_queue);
+    for (uint64_t i = 0; i < count; i++) {
+        fs_cmpl_t cmpl = fs_queue_idx_filled(server_completion_queue, i)->cmpl;
+        if (cmpl.id >= FS_QUEUE_CAPACITY || !requests[cmpl.id].in_use) {
+            LOG_FS_VIRT("completion for unknown request %lu\n", cmpl.id);
+            continue;
+        }
+
+        request_t *req = &requests[cmpl.id];
+        uint64_t client = req->client;
+        bool success = cmpl.status == FS_STATUS_SUCCESS;
+
+        switch (req->type) {
+        case FS_CMD_INITIALISE:
+            mount_state = success ? MOUNT_DONE : MOUNT_NONE;
+            break;
+        case FS_CMD_FILE_OPEN:
+            if (success) {
+                set_fd_owner(file_owners, client, cmpl.data.file_open.fd);
+            }
+            break;
+        case FS_CMD_DIR_OPEN:
+            if (success) {
+                set_fd_owner(dir_owners, client, cmpl.data.dir_open.fd);
+            }
+            break;
+        case FS_CMD_FILE_CLOSE:
+            if (success) {
+                clear_fd_owner(file_owners, req->fd);
+            }
+            break;
+        case FS_CMD_DIR_CLOSE:
+            if (success) {
+                clear_fd_owner(dir_owners, req->fd);
+            }
+            break;
+        }
+
+        cmpl.id = req->client_request_id;
+        client_outstanding[client]--;
+        request_free(req);
+        client_reply(client, cmpl);
+    }
+    fs_queue_publish_consumption(server_completion_queue, count);
+}
+
+void notified(microkit_channel ch) {
+    process_completions();
+    process_commands();
+
+    if (server_notify) {
+        server_notify = false;
+        microkit_notify(FS_VIRT_SERVER_CH);
+    }
+    for (uint64_t i = 0; i < FS_VIRT_NUM_CLIENTS; i++) {
+        if (client_notify[i]) {
+            client_notify[i] = false;
+            microkit_notify(FS_VIRT_CLIENT_CH_BASE + i);
+        }
+    }
+}
+
+void init(void) {
+    first_free_request = &requests[0];
+    for (uint64_t i = 0; i + 1 < FS_QUEUE_CAPACITY; i++) {
+        requests[i].next_free = &requests[i + 1];
+    }
+}
@@ -17,6 +17,14 @@ async def stat(path):
     await flag.wait()
     return fs_raw.complete_stat(request)
 
+# Stat a path and read up to the first 0x8000 bytes of it in a single
+# request. Returns a (stat, data) tuple, data is empty for a directory.
+async def fetch(path):
+    flag = asyncio.ThreadSafeFlag()
+    request = fs_raw.request_fetch(path, flag)
+    await flag.wait()
+    return fs_raw.complete_fetch(request)
+
 class AsyncFile:
     def __init__(self, fd):
         self.fd = fd
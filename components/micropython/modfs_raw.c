@@ -158,6 +158,21 @@ STATIC mp_obj_t complete_pread(mp_obj_t request_id_in) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(complete_pread_obj, complete_pread);
 
+STATIC mp_obj_t stat_to_tuple(fs_stat_t *sb) {
+    mp_obj_tuple_t *t = MP_OBJ_TO_PTR(mp_obj_new_tuple(10, NULL));
+    t->items[0] = MP_OBJ_NEW_SMALL_INT(sb->mode);
+    t->items[1] = mp_obj_new_int_from_uint(sb->ino);
+    t->items[2] = mp_obj_new_int_from_uint(sb->dev);
+    t->items[3] = mp_obj_new_int_from_uint(sb->nlink);
+    t->items[4] = mp_obj_new_int_from_uint(sb->uid);
+    t->items[5] = mp_obj_new_int_from_uint(sb->gid);
+    t->items[6] = mp_obj_new_int_from_uint(sb->size);
+    t->items[7] = mp_obj_new_int_from_uint(sb->atime);
+    t->items[8] = mp_obj_new_int_from_uint(sb->mtime);
+    t->items[9] = mp_obj_new_int_from_uint(sb->ctime);
+    return MP_OBJ_FROM_PTR(t);
+}
+
 STATIC mp_obj_t request_stat(mp_obj_t path_in, mp_obj_t flag_in) {
     const char *path = mp_obj_str_get_str(path_in);
 
@@ -218,24 +233,96 @@ STATIC mp_obj_t complete_stat(mp_obj_t request_id_in) {
         return mp_const_none;
     }
 
-    fs_stat_t *sb = fs_buffer_ptr(command.params.stat.buf.offset);
-    mp_obj_tuple_t *t = MP_OBJ_TO_PTR(mp_obj_new_tuple(10, NULL));
-    t->items[0] = MP_OBJ_NEW_SMALL_INT(sb->mode);
-    t->items[1] = mp_obj_new_int_from_uint(sb->ino);
-    t->items[2] = mp_obj_new_int_from_uint(sb->dev);
-    t->items[3] = mp_obj_new_int_from_uint(sb->nlink);
-    t->items[4] = mp_obj_new_int_from_uint(sb->uid);
-    t->items[5] = mp_obj_new_int_from_uint(sb->gid);
-    t->items[6] = mp_obj_new_int_from_uint(sb->size);
-    t->items[7] = mp_obj_new_int_from_uint(sb->atime);
-    t->items[8] = mp_obj_new_int_from_uint(sb->mtime);
-    t->items[9] = mp_obj_new_int_from_uint(sb->ctime);
+    mp_obj_t t = stat_to_tuple(fs_buffer_ptr(command.params.stat.buf.offset));
     fs_buffer_free(command.params.stat.buf.offset);
 
-    return MP_OBJ_FROM_PTR(t);
+    return t;
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(complete_stat_obj, complete_stat);
 
+STATIC mp_obj_t request_fetch(mp_obj_t path_in, mp_obj_t flag_in) {
+    const char *path = mp_obj_str_get_str(path_in);
+
+    uint64_t request_id;
+    int err = fs_request_allocate(&request_id);
+    if (err) {
+        mp_raise_OSError(err);
+        return mp_const_none;
+    }
+
+    ptrdiff_t path_buffer;
+    err = fs_buffer_allocate(&path_buffer);
+    if (err) {
+        fs_request_free(request_id);
+        mp_raise_OSError(err);
+        return mp_const_none;
+    }
+
+    ptrdiff_t stat_buffer;
+    err = fs_buffer_allocate(&stat_buffer);
+    if (err) {
+        fs_request_free(request_id);
+        fs_buffer_free(path_buffer);
+        mp_raise_OSError(err);
+        return mp_const_none;
+    }
+
+    ptrdiff_t read_buffer;
+    err = fs_buffer_allocate(&read_buffer);
+    if (err) {
+        fs_request_free(request_id);
+        fs_buffer_free(path_buffer);
+        fs_buffer_free(stat_buffer);
+        mp_raise_OSError(err);
+        return mp_const_none;
+    }
+
+    uint64_t path_len = strlen(path);
+    memcpy(fs_buffer_ptr(path_buffer), path, path_len);
+
+    request_flags[request_id] = flag_in;
+    fs_command_issue((fs_cmd_t){
+        .id = request_id,
+        .type = FS_CMD_FILE_FETCH,
+        .params.file_fetch = {
+            .path.offset = path_buffer,
+            .path.size = path_len,
+            .stat.offset = stat_buffer,
+            .stat.size = FS_BUFFER_SIZE,
+            .buf.offset = read_buffer,
+            .buf.size = FS_BUFFER_SIZE,
+        }
+    });
+    return mp_obj_new_int_from_uint(request_id);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(request_fetch_obj, request_fetch);
+
+STATIC mp_obj_t complete_fetch(mp_obj_t request_id_in) {
+    uint64_t request_id = mp_obj_get_int(request_id_in);
+
+    fs_cmd_t command;
+    fs_cmpl_t completion;
+    fs_command_complete(request_id, &command, &completion);
+    fs_request_free(request_id);
+    fs_buffer_free(command.params.file_fetch.path.offset);
+
+    if (completion.status != FS_STATUS_SUCCESS) {
+        fs_buffer_free(command.params.file_fetch.stat.offset);
+        fs_buffer_free(command.params.file_fetch.buf.offset);
+        mp_raise_OSError(completion.status);
+        return mp_const_none;
+    }
+
+    mp_obj_t items[2];
+    items[0] = stat_to_tuple(fs_buffer_ptr(command.params.file_fetch.stat.offset));
+    items[1] = mp_obj_new_bytes(fs_buffer_ptr(command.params.file_fetch.buf.offset), completion.data.file_fetch.len_read);
+    fs_buffer_free(command.params.file_fetch.stat.offset);
+    fs_buffer_free(command.params.file_fetch.buf.offset);
+
+    return mp_obj_new_tuple(2, items);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(complete_fetch_obj, complete_fetch);
+
 STATIC const mp_rom_map_elem_t fs_raw_module_globals_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_fs_raw) },
     { MP_ROM_QSTR(MP_QSTR_request_open), MP_ROM_PTR(&request_open_obj) },
@@ -246,6 +333,8 @@ STATIC const mp_rom_map_elem_t fs_raw_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_complete_pread), MP_ROM_PTR(&complete_pread_obj) },
     { MP_ROM_QSTR(MP_QSTR_request_stat), MP_ROM_PTR(&request_stat_obj) },
     { MP_ROM_QSTR(MP_QSTR_complete_stat), MP_ROM_PTR(&complete_stat_obj) },
+    { MP_ROM_QSTR(MP_QSTR_request_fetch), MP_ROM_PTR(&request_fetch_obj) },
+    { MP_ROM_QSTR(MP_QSTR_complete_fetch), MP_ROM_PTR(&complete_fetch_obj) },
 };
 STATIC MP_DEFINE_CONST_DICT(fs_raw_module_globals, fs_raw_module_globals_table);
 
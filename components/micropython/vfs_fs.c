@@ -15,6 +15,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
 typedef struct _mp_obj_vfs_fs_t {
     mp_obj_base_t base;
@@ -149,52 +150,91 @@ typedef struct _vfs_fs_ilistdir_it_t {
     mp_fun_1_t iternext;
     bool is_str;
     uint64_t dir;
+    // entries from the last FS_CMD_DIR_READ_BATCH that have not been returned yet
+    byte *batch;
+    size_t batch_len;
+    size_t batch_pos;
+    uint64_t batch_remaining;
 } vfs_fs_ilistdir_it_t;
 
+STATIC bool vfs_fs_ilistdir_it_fill(vfs_fs_ilistdir_it_t *self) {
+    ptrdiff_t batch_buffer;
+    int err = fs_buffer_allocate(&batch_buffer);
+    assert(!err);
+
+    fs_cmpl_t completion;
+    fs_command_blocking(&completion, (fs_cmd_t){
+        .type = FS_CMD_DIR_READ_BATCH,
+        .params.dir_read_batch = {
+            .fd = self->dir,
+            .buf.offset = batch_buffer,
+            .buf.size = FS_BUFFER_SIZE,
+        }
+    });
+
+    if (completion.status != FS_STATUS_SUCCESS) {
+        fs_buffer_free(batch_buffer);
+        return false;
+    }
+
+    // Copy out only the part of the buffer that holds entries so the fs buffer
+    // can be given back straight away
+    byte *entries = fs_buffer_ptr(batch_buffer);
+    uint64_t num_entries = completion.data.dir_read_batch.num_entries;
+    size_t len = 0;
+    for (uint64_t i = 0; i < num_entries; i++) {
+        fs_dirent_t dirent;
+        memcpy(&dirent, entries + len, sizeof dirent);
+        len += FS_DIRENT_SIZE(dirent.name_len);
+    }
+
+    if (self->batch_len < len) {
+        self->batch = m_renew(byte, self->batch, self->batch_len, len);
+        self->batch_len = len;
+    }
+    memcpy(self->batch, entries, len);
+    fs_buffer_free(batch_buffer);
+
+    self->batch_pos = 0;
+    self->batch_remaining = num_entries;
+    return num_entries != 0;
+}
+
 STATIC mp_obj_t vfs_fs_ilistdir_it_iternext(mp_obj_t self_in) {
     vfs_fs_ilistdir_it_t *self = MP_OBJ_TO_PTR(self_in);
 
     for (;;) {
-        ptrdiff_t name_buffer;
-        int err = fs_buffer_allocate(&name_buffer);
-        assert(!err);
-
-        fs_cmpl_t completion;
-        fs_command_blocking(&completion, (fs_cmd_t){
-            .type = FS_CMD_DIR_READ,
-            .params.dir_read = {
-                .fd = self->dir,
-                .buf.offset = name_buffer,
-                .buf.size = FS_BUFFER_SIZE,
-            }
-        });
-
-        if (completion.status != FS_STATUS_SUCCESS) {
-            fs_buffer_free(name_buffer);
+        if (self->batch_remaining == 0 && !vfs_fs_ilistdir_it_fill(self)) {
             break;
         }
 
-        const char *fn = fs_buffer_ptr(name_buffer);
+        fs_dirent_t dirent;
+        memcpy(&dirent, self->batch + self->batch_pos, sizeof dirent);
+        const char *fn = (const char *)self->batch + self->batch_pos + sizeof dirent;
+        uint64_t path_len = dirent.name_len;
+        self->batch_pos += FS_DIRENT_SIZE(path_len);
+        self->batch_remaining--;
 
-        if (fn[0] == '.' && (fn[1] == 0 || fn[1] == '.')) {
+        if (fn[0] == '.' && (path_len == 1 || (path_len == 2 && fn[1] == '.'))) {
             // skip . and ..
-            fs_buffer_free(name_buffer);
             continue;
         }
 
-        // make 3-tuple with info about this entry
-        mp_obj_tuple_t *t = MP_OBJ_TO_PTR(mp_obj_new_tuple(3, NULL));
+        // make 4-tuple with info about this entry
+        mp_obj_tuple_t *t = MP_OBJ_TO_PTR(mp_obj_new_tuple(4, NULL));
 
-        uint64_t path_len = completion.data.dir_read.path_len;
         if (self->is_str) {
             t->items[0] = mp_obj_new_str(fn, path_len);
         } else {
             t->items[0] = mp_obj_new_bytes((const byte *)fn, path_len);
         }
-        t->items[1] = MP_OBJ_NEW_SMALL_INT(0);
-        t->items[2] = MP_OBJ_NEW_SMALL_INT(0);
-
-        fs_buffer_free(name_buffer);
+        if (S_ISDIR(dirent.stat.mode)) {
+            t->items[1] = MP_OBJ_NEW_SMALL_INT(MP_S_IFDIR);
+        } else {
+            t->items[1] = MP_OBJ_NEW_SMALL_INT(MP_S_IFREG);
+        }
+        t->items[2] = mp_obj_new_int_from_uint(dirent.stat.ino);
+        t->items[3] = mp_obj_new_int_from_uint(dirent.stat.size);
 
         return MP_OBJ_FROM_PTR(t);
     }
@@ -205,6 +245,9 @@ STATIC mp_obj_t vfs_fs_ilistdir_it_iternext(mp_obj_t self_in) {
         .params.dir_close.fd = self->dir,
     });
     self->dir = 0;
+    m_del(byte, self->batch, self->batch_len);
+    self->batch = NULL;
+    self->batch_len = 0;
     return MP_OBJ_STOP_ITERATION;
 }
 
@@ -213,6 +256,10 @@ STATIC mp_obj_t vfs_fs_ilistdir(mp_obj_t self_in, mp_obj_t path_in) {
     vfs_fs_ilistdir_it_t *iter = mp_obj_malloc(vfs_fs_ilistdir_it_t, &mp_type_polymorph_iter);
     iter->iternext = vfs_fs_ilistdir_it_iternext;
     iter->is_str = mp_obj_get_type(path_in) == &mp_type_str;
+    iter->batch = NULL;
+    iter->batch_len = 0;
+    iter->batch_pos = 0;
+    iter->batch_remaining = 0;
     const char *path = vfs_fs_get_path_str(self, path_in);
     if (path[0] == '\0') {
         path = ".";
@@ -43,6 +43,163 @@ STATIC mp_obj_t vfs_fs_file___exit__(size_t n_args, const mp_obj_t *args) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(vfs_fs_file___exit___obj, 4, 4, vfs_fs_file___exit__);
 
+// allocate(offset, length): reserve space for the file up to offset + length, growing it if needed
+STATIC mp_obj_t vfs_fs_file_allocate(mp_obj_t self_in, mp_obj_t offset_in, mp_obj_t length_in) {
+    mp_obj_vfs_fs_file_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_int_t offset = mp_obj_get_int(offset_in);
+    mp_int_t length = mp_obj_get_int(length_in);
+    if (offset < 0 || length <= 0 || offset > MP_SSIZE_MAX - length) {
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid offset or length"));
+    }
+
+    fs_cmpl_t completion;
+    int err = fs_command_blocking(&completion, (fs_cmd_t){
+        .type = FS_CMD_FILE_ALLOCATE,
+        .params.file_allocate = {
+            .fd = self->fd,
+            .offset = offset,
+            .length = length,
+        }
+    });
+    if (err || completion.status != FS_STATUS_SUCCESS) {
+        mp_raise_OSError(completion.status);
+        return mp_const_none;
+    }
+    if ((uint64_t)(offset + length) > self->size) {
+        self->size = offset + length;
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_3(vfs_fs_file_allocate_obj, vfs_fs_file_allocate);
+
+// Lay out the buffers of a preadv/pwritev back to back in one fs buffer, described by an iov array in another
+STATIC void vfs_fs_file_iov_setup(size_t iovcnt, const mp_obj_t *buffers, mp_uint_t flags, ptrdiff_t *iov_buffer, ptrdiff_t *data_buffer) {
+    if (iovcnt == 0 || iovcnt > FS_MAX_IOV) {
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid number of buffers"));
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        mp_buffer_info_t bufinfo;
+        mp_get_buffer_raise(buffers[i], &bufinfo, flags);
+        total += bufinfo.len;
+    }
+    if (total > FS_BUFFER_SIZE) {
+        mp_raise_ValueError(MP_ERROR_TEXT("buffers too large"));
+    }
+
+    int err = fs_buffer_allocate(iov_buffer);
+    if (err) {
+        mp_raise_OSError(err);
+    }
+    err = fs_buffer_allocate(data_buffer);
+    if (err) {
+        fs_buffer_free(*iov_buffer);
+        mp_raise_OSError(err);
+    }
+
+    fs_buffer_t *iov = fs_buffer_ptr(*iov_buffer);
+    char *data = fs_buffer_ptr(*data_buffer);
+    size_t pos = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        mp_buffer_info_t bufinfo;
+        mp_get_buffer(buffers[i], &bufinfo, flags);
+        iov[i].offset = *data_buffer + pos;
+        iov[i].size = bufinfo.len;
+        if (flags == MP_BUFFER_READ) {
+            memcpy(data + pos, bufinfo.buf, bufinfo.len);
+        }
+        pos += bufinfo.len;
+    }
+}
+
+// preadv(buffers, offset): fill each writable buffer in turn from offset, returning the number of bytes read
+STATIC mp_obj_t vfs_fs_file_preadv(mp_obj_t self_in, mp_obj_t buffers_in, mp_obj_t offset_in) {
+    mp_obj_vfs_fs_file_t *self = MP_OBJ_TO_PTR(self_in);
+    size_t iovcnt;
+    mp_obj_t *buffers;
+    mp_obj_get_array(buffers_in, &iovcnt, &buffers);
+    mp_int_t offset = mp_obj_get_int(offset_in);
+    if (offset < 0) {
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid offset"));
+    }
+
+    ptrdiff_t iov_buffer;
+    ptrdiff_t data_buffer;
+    vfs_fs_file_iov_setup(iovcnt, buffers, MP_BUFFER_WRITE, &iov_buffer, &data_buffer);
+
+    fs_cmpl_t completion;
+    int err = fs_command_blocking(&completion, (fs_cmd_t){
+        .type = FS_CMD_FILE_READV,
+        .params.file_readv = {
+            .fd = self->fd,
+            .offset = offset,
+            .iov.offset = iov_buffer,
+            .iov.size = iovcnt * sizeof (fs_buffer_t),
+        }
+    });
+    fs_buffer_free(iov_buffer);
+    if (err || completion.status != FS_STATUS_SUCCESS) {
+        fs_buffer_free(data_buffer);
+        mp_raise_OSError(completion.status);
+        return mp_const_none;
+    }
+
+    uint64_t len_read = completion.data.file_readv.len_read;
+    const char *data = fs_buffer_ptr(data_buffer);
+    uint64_t pos = 0;
+    for (size_t i = 0; i < iovcnt && pos < len_read; i++) {
+        mp_buffer_info_t bufinfo;
+        mp_get_buffer(buffers[i], &bufinfo, MP_BUFFER_WRITE);
+        size_t len = (len_read - pos < bufinfo.len) ? len_read - pos : bufinfo.len;
+        memcpy(bufinfo.buf, data + pos, len);
+        pos += len;
+    }
+    fs_buffer_free(data_buffer);
+
+    return mp_obj_new_int_from_uint(len_read);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_3(vfs_fs_file_preadv_obj, vfs_fs_file_preadv);
+
+// pwritev(buffers, offset): write out each buffer in turn from offset, returning the number of bytes written
+STATIC mp_obj_t vfs_fs_file_pwritev(mp_obj_t self_in, mp_obj_t buffers_in, mp_obj_t offset_in) {
+    mp_obj_vfs_fs_file_t *self = MP_OBJ_TO_PTR(self_in);
+    size_t iovcnt;
+    mp_obj_t *buffers;
+    mp_obj_get_array(buffers_in, &iovcnt, &buffers);
+    mp_int_t offset = mp_obj_get_int(offset_in);
+    if (offset < 0) {
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid offset"));
+    }
+
+    ptrdiff_t iov_buffer;
+    ptrdiff_t data_buffer;
+    vfs_fs_file_iov_setup(iovcnt, buffers, MP_BUFFER_READ, &iov_buffer, &data_buffer);
+
+    fs_cmpl_t completion;
+    int err = fs_command_blocking(&completion, (fs_cmd_t){
+        .type = FS_CMD_FILE_WRITEV,
+        .params.file_writev = {
+            .fd = self->fd,
+            .offset = offset,
+            .iov.offset = iov_buffer,
+            .iov.size = iovcnt * sizeof (fs_buffer_t),
+        }
+    });
+    fs_buffer_free(iov_buffer);
+    fs_buffer_free(data_buffer);
+    if (err || completion.status != FS_STATUS_SUCCESS) {
+        mp_raise_OSError(completion.status);
+        return mp_const_none;
+    }
+
+    uint64_t len_written = completion.data.file_writev.len_written;
+    if (offset + len_written > self->size) {
+        self->size = offset + len_written;
+    }
+    return mp_obj_new_int_from_uint(len_written);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_3(vfs_fs_file_pwritev_obj, vfs_fs_file_pwritev);
+
 STATIC mp_uint_t vfs_fs_file_read(mp_obj_t o_in, void *buf, mp_uint_t size, int *errcode) {
     mp_obj_vfs_fs_file_t *o = MP_OBJ_TO_PTR(o_in);
     // check_fd_is_open(o);
@@ -178,6 +335,9 @@ STATIC const mp_rom_map_elem_t vfs_fs_rawfile_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_seek), MP_ROM_PTR(&mp_stream_seek_obj) },
     { MP_ROM_QSTR(MP_QSTR_tell), MP_ROM_PTR(&mp_stream_tell_obj) },
     { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&mp_stream_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_allocate), MP_ROM_PTR(&vfs_fs_file_allocate_obj) },
+    { MP_ROM_QSTR(MP_QSTR_preadv), MP_ROM_PTR(&vfs_fs_file_preadv_obj) },
+    { MP_ROM_QSTR(MP_QSTR_pwritev), MP_ROM_PTR(&vfs_fs_file_pwritev_obj) },
     { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&mp_stream_close_obj) },
     { MP_ROM_QSTR(MP_QSTR___enter__), MP_ROM_PTR(&mp_identity_obj) },
     { MP_ROM_QSTR(MP_QSTR___exit__), MP_ROM_PTR(&vfs_fs_file___exit___obj) },
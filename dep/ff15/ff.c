@@ -63,8 +63,6 @@
 
 /* Additional file access control and file status flags for internal use */
 #define FA_SEEKEND	0x20	/* Seek to end of the file on file open */
-#define FA_MODIFIED	0x40	/* File has been modified */
-#define FA_DIRTY	0x80	/* FIL.buf[] needs to be written-back */
 
 
 /* Additional file attribute bits for internal use */
@@ -505,6 +503,9 @@ static const BYTE GUID_MS_Basic[16] = {0xA2,0xA0,0xD0,0xEB,0xE5,0xB9,0x33,0x44,0
 #if FF_FS_EXFAT
 #error LFN must be enabled when enable exFAT
 #endif
+#if FF_USE_DCACHE
+#error LFN must be enabled when enable directory entry cache
+#endif
 #define DEF_NAMBUF
 #define INIT_NAMBUF(fs)
 #define FREE_NAMBUF()
@@ -1292,6 +1293,9 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			break;
 		}
 	}
+#if FF_USE_FREEMAP
+	if (res == FR_OK) ff_freemap_set(fs, clst, val != 0);	/* Keep the free cluster map in sync */
+#endif
 	return res;
 }
 
@@ -1591,6 +1595,13 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 				ncl = 0;
 			}
 		}
+#if FF_USE_FREEMAP
+		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
+			ncl = ff_freemap_find(fs, scl);		/* Find it in the free cluster map */
+			if (ncl == 0) return 0;				/* No free cluster found? */
+			if (ncl == 1) ncl = 0;				/* Map not available, search the FAT */
+		}
+#endif
 		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
 			ncl = scl;	/* Start cluster */
 			for (;;) {
@@ -2465,6 +2476,67 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if FF_USE_DCACHE
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Find an object through the entry cache           */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT dir_load_cached (	/* FR_OK(0):loaded, !=0:entry is not valid any more */
+	DIR* dp,					/* Directory object to point the cached entry */
+	DWORD ofs,					/* Offset of the SFN entry (FAT) */
+	DWORD blk_ofs				/* Offset of the top of the entry block */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+
+
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+		res = dir_sdi(dp, blk_ofs);
+		if (res == FR_OK) res = load_xdir(dp);	/* Fails if the entry has been deleted */
+		if (res != FR_OK) return res;
+		if (ld_word(fs->dirbuf + XDIR_NameHash) != xname_sum(fs->lfnbuf)) return FR_NO_FILE;
+		dp->blk_ofs = blk_ofs;
+		dp->obj.attr = fs->dirbuf[XDIR_Attr] & AM_MASK;
+		return FR_OK;
+	}
+#endif
+	/* On the FAT/FAT32 volume */
+	res = dir_sdi(dp, ofs);
+	if (res == FR_OK) res = move_window(fs, dp->sect);
+	if (res != FR_OK) return res;
+	if (dp->dir[DIR_Name] == 0 || dp->dir[DIR_Name] == DDEM) return FR_NO_FILE;
+	dp->blk_ofs = blk_ofs;
+	dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+	return FR_OK;
+}
+
+
+static FRESULT dir_lookup (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp					/* Pointer to the directory object with the file name */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DWORD ofs, blk_ofs;
+
+
+	if (dp->fn[NSFLAG] & NS_DOT) return dir_find(dp);	/* Dot entries are not cached */
+	if (ff_dcache_lookup(fs, dp->obj.sclust, fs->lfnbuf, &ofs, &blk_ofs)) {
+		if (dir_load_cached(dp, ofs, blk_ofs) == FR_OK) return FR_OK;
+	}
+	res = dir_find(dp);
+	if (res == FR_OK) {
+		ff_dcache_insert(fs, dp->obj.sclust, fs->lfnbuf, dp->dptr, dp->blk_ofs);
+	}
+	return res;
+}
+#endif
+
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Register an object to the directory                                   */
@@ -2585,6 +2657,9 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 #if FF_USE_LFN		/* LFN configuration */
 	DWORD last = dp->dptr;
 
+#if FF_USE_DCACHE
+	ff_dcache_flush(fs);	/* Removing a directory also frees its cluster for reuse, so drop every cached entry */
+#endif
 	res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);	/* Goto top of the entry block if LFN is exist */
 	if (res == FR_OK) {
 		do {
@@ -3100,7 +3175,11 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 		for (;;) {
 			res = create_name(dp, &path);	/* Get a segment name of the path */
 			if (res != FR_OK) break;
+#if FF_USE_DCACHE
+			res = dir_lookup(dp);			/* Find an object with the segment name */
+#else
 			res = dir_find(dp);				/* Find an object with the segment name */
+#endif
 			ns = dp->fn[NSFLAG];
 			if (res != FR_OK) {				/* Failed to find the object */
 				if (res == FR_NO_FILE) {	/* Object is not found */
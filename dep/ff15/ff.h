@@ -390,6 +390,15 @@ void ff_mutex_delete (int vol);		/* Delete a sync object */
 int ff_mutex_take (int vol);		/* Lock sync object */
 void ff_mutex_give (int vol);		/* Unlock sync object */
 #endif
+#if FF_USE_DCACHE	/* Directory entry cache functions */
+int ff_dcache_lookup (FATFS* fs, DWORD dclust, const WCHAR* name, DWORD* ofs, DWORD* blk_ofs);	/* Find a cached entry location */
+void ff_dcache_insert (FATFS* fs, DWORD dclust, const WCHAR* name, DWORD ofs, DWORD blk_ofs);	/* Cache an entry location */
+void ff_dcache_flush (FATFS* fs);	/* Drop all cached entries of the volume */
+#endif
+#if FF_USE_FREEMAP	/* Free cluster map functions */
+DWORD ff_freemap_find (FATFS* fs, DWORD scl);	/* Find a free cluster following scl (0:No free cluster, 1:Map not available) */
+void ff_freemap_set (FATFS* fs, DWORD clst, int used);	/* Record the new status of a FAT entry */
+#endif
 
 
 
@@ -407,6 +416,10 @@ void ff_mutex_give (int vol);		/* Unlock sync object */
 #define	FA_OPEN_ALWAYS		0x10
 #define	FA_OPEN_APPEND		0x30
 
+/* File status flags in FIL.flag, for users accessing the file's sectors directly */
+#define FA_MODIFIED	0x40	/* File has been modified */
+#define FA_DIRTY	0x80	/* FIL.buf[] needs to be written-back */
+
 /* Fast seek controls (2nd argument of f_lseek) */
 #define CREATE_LINKMAP	((FSIZE_t)0 - 1)
 
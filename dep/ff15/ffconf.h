@@ -40,11 +40,23 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_USE_DCACHE	1
+/* This option switches the directory entry cache for path lookups. (0:Disable or 1:Enable)
+/  When enable, ff_dcache_lookup(), ff_dcache_insert() and ff_dcache_flush() need to be
+/  added to the project. It requires FF_USE_LFN >= 1. */
+
+
+#define FF_USE_FREEMAP	1
+/* This option switches the free cluster map for cluster allocation on FAT/FAT32 volumes.
+/  (0:Disable or 1:Enable) When enable, ff_freemap_find() and ff_freemap_set() need to be
+/  added to the project. */
+
+
+#define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
@@ -219,7 +231,7 @@
 /  f_fdisk function. 0x100000000 max. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
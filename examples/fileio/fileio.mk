@@ -76,6 +76,37 @@ CFLAGS := \
 	-I${CONFIG_INCLUDE} \
 	-DVIRTIO_MMIO_NET_OFFSET=0xc00
 
+SYSTEM_SRC := ${FILEIO_DIR}/board/$(MICROKIT_BOARD)/fileio.system
+
+# Give the FAT server a second block connection so that large reads go straight into
+# the client's buffers, the system file is preprocessed with the same flag
+ifeq ($(strip $(FILEIO_ZERO_COPY)),1)
+	CFLAGS += -DFILEIO_ZERO_COPY
+	SYSTEM_CPPFLAGS += -DFILEIO_ZERO_COPY
+endif
+
+# Share the FAT server between MicroPython and a second, native client through the fs
+# virtualiser. The FAT server's data region then holds the data regions of both clients
+# and the virtualiser's scratch region, which must cover FS_VIRT_SERVER_DATA_REGION_SIZE
+# and match the regions mapped in the system file.
+ifeq ($(strip $(FILEIO_FS_VIRT)),1)
+	IMAGES += fs_virt.elf fs_client.elf
+	FILEIO_FS_DATA_REGION_SIZE := 0x8080000
+	CFLAGS += -DFILEIO_FS_VIRT -DFILEIO_FS_DATA_REGION_SIZE=$(FILEIO_FS_DATA_REGION_SIZE)
+	SYSTEM_CPPFLAGS += -DFILEIO_FS_VIRT
+endif
+
+# Number of FAT worker threads, a stack region and mapping is generated for each and
+# the FAT blk queues are sized to match
+FAT_WORKER_THREAD_NUM ?= 4
+CFLAGS += -DFAT_WORKER_THREAD_NUM=$(FAT_WORKER_THREAD_NUM)
+SYSTEM_FILE := fileio.system
+
+# Must match FAT_WORKER_THREAD_STACKSIZE and FAT_WORKER_THREAD_STACK_STRIDE in fat_config.h
+FAT_WORKER_STACK_SIZE := 0x40000
+FAT_WORKER_STACK_STRIDE := 0x41000
+FAT_WORKER_STACK_VADDR := 0xA0000000
+FAT_WORKER_STACKS := $(shell seq 0 $$(($(FAT_WORKER_THREAD_NUM) - 1)))
 
 LDFLAGS := -L$(BOARD_DIR)/lib
 LIBS := -lmicrokit -Tmicrokit.ld libsddf_util_debug.a
@@ -84,7 +115,7 @@ IMAGE_FILE := fileio.img
 REPORT_FILE := report.txt
 
 all: cache.o
-CHECK_FLAGS_BOARD_MD5:=.board_cflags-$(shell echo -- ${CFLAGS} ${BOARD} ${MICROKIT_CONFIG} | shasum | sed 's/ *-//')
+CHECK_FLAGS_BOARD_MD5:=.board_cflags-$(shell echo -- ${CFLAGS} ${BOARD} ${MICROKIT_CONFIG} ${FAT_WORKER_THREAD_NUM} | shasum | sed 's/ *-//')
 
 ${CHECK_FLAGS_BOARD_MD5}:
 	-rm -f .board_cflags-*
@@ -107,6 +138,7 @@ include ${SDDF}/serial/components/serial_components.mk
 include ${SDDF}/libco/libco.mk
 include ${BLK_DRIVER}/${BLK_MK}
 include ${BLK_COMPONENTS}/blk_components.mk
+include ${LIONSOS}/components/fs/virt/fs_virt.mk
 
 micropython.elf: mpy-cross libsddf_util_debug.a libco.a
 	cp $(LIONSOS)/examples/fileio/fs_test.py .
@@ -136,8 +168,14 @@ fat.elf: musllibc/lib/libc.a
 		LIBC_DIR=$(abspath $(BUILD_DIR)/musllibc) \
 		BUILD_DIR=$(abspath .) \
 		CONFIG_INCLUDE=$(abspath $(CONFIG_INCLUDE)) \
+		FAT_ZERO_COPY=$(FILEIO_ZERO_COPY) \
+		FAT_WORKER_THREAD_NUM=$(FAT_WORKER_THREAD_NUM) \
+		FAT_FS_DATA_REGION_SIZE=$(FILEIO_FS_DATA_REGION_SIZE) \
 		TARGET=$(TARGET)
 
+fs_client.o: ${FILEIO_DIR}/src/fs_client/fs_client.c
+	${CC} ${CFLAGS} -I$(LIONSOS)/include -c -o $@ $<
+
 musllibc/lib/libc.a:
 	make -C $(MUSL) \
 		C_COMPILER=aarch64-none-elf-gcc \
@@ -151,8 +189,24 @@ ${IMAGES}: libsddf_util_debug.a
 %.o: %.c
 	${CC} ${CFLAGS} -c -o $@ $<
 
-$(IMAGE_FILE) $(REPORT_FILE): $(IMAGES) ${FILEIO_DIR}/board/$(MICROKIT_BOARD)/fileio.system
-	$(MICROKIT_TOOL) ${FILEIO_DIR}/board/$(MICROKIT_BOARD)/fileio.system \
+fat_worker_stack_regions.xml: $(CHECK_FLAGS_BOARD_MD5)
+	for i in $(FAT_WORKER_STACKS); do \
+		echo "    <memory_region name=\"fat_worker_stack$$i\" size=\"$(FAT_WORKER_STACK_SIZE)\" page_size=\"0x1000\"/>"; \
+	done > $@
+
+# The first stack also tells the FAT server where the stacks start
+fat_worker_stack_maps.xml: $(CHECK_FLAGS_BOARD_MD5)
+	for i in $(FAT_WORKER_STACKS); do \
+		setvar=; [ $$i -eq 0 ] && setvar=' setvar_vaddr="worker_thread_stacks"'; \
+		printf '        <map mr="fat_worker_stack%d" vaddr="0x%x" perms="rw" cached="true"%s />\n' \
+			$$i $$(($(FAT_WORKER_STACK_VADDR) + $$i * $(FAT_WORKER_STACK_STRIDE))) "$$setvar"; \
+	done > $@
+
+$(SYSTEM_FILE): $(SYSTEM_SRC) fat_worker_stack_regions.xml fat_worker_stack_maps.xml $(CHECK_FLAGS_BOARD_MD5)
+	cpp -P -I. $(SYSTEM_CPPFLAGS) $< -o $@
+
+$(IMAGE_FILE) $(REPORT_FILE): $(IMAGES) $(SYSTEM_FILE)
+	$(MICROKIT_TOOL) $(SYSTEM_FILE) \
 		--search-path $(BUILD_DIR) \
 		--board $(MICROKIT_BOARD) \
 		--config $(MICROKIT_CONFIG) \
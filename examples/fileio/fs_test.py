@@ -2,6 +2,8 @@
 # SPDX-License-Identifier: BSD-2-Clause
 
 import os
+import asyncio
+import fs_async
 
 # Initialize counters
 success_count = 0
@@ -357,6 +359,272 @@ def test_truncate_using_open_flag(directory):
             os.remove(test_file)
             # print(f"File '{test_file}' removed after test.")
 
+def test_ilistdir_batches(directory):
+    """Test that ilistdir returns every entry of a directory larger than one batch with its attributes."""
+    global success_count, fail_count
+
+    list_dir = path_join(directory, "test_ilistdir")
+    sub_dir_name = "sub_dir"
+    # Each entry takes over 150 bytes of a 32 KiB batch buffer, so this needs at least two batches
+    file_count = 300
+    file_names = ["entry_%03d" % i for i in range(file_count)]
+
+    try:
+        os.mkdir(list_dir)
+        os.mkdir(path_join(list_dir, sub_dir_name))
+        for index, name in enumerate(file_names):
+            with open(path_join(list_dir, name), "w") as f:
+                f.write("x" * (index % 50))
+
+        seen = {}
+        for entry in os.ilistdir(list_dir):
+            assert len(entry) == 4, f"Test failed: Expected a 4-tuple from ilistdir, Got: {entry}"
+            assert entry[0] not in seen, f"Test failed: Entry '{entry[0]}' returned more than once."
+            seen[entry[0]] = entry
+
+        assert len(seen) == file_count + 1, (
+            f"Test failed: Expected {file_count + 1} entries, Got: {len(seen)}"
+        )
+        assert seen[sub_dir_name][1] == 0x4000, "Test failed: Directory entry does not have the directory type."
+        for index, name in enumerate(file_names):
+            assert name in seen, f"Test failed: Entry '{name}' is missing from the listing."
+            _, entry_type, _, entry_size = seen[name]
+            assert entry_type == 0x8000, f"Test failed: Entry '{name}' does not have the file type."
+            assert entry_size == index % 50, (
+                f"Test failed: Entry '{name}' has size {entry_size}, Expected: {index % 50}"
+            )
+
+        # Listing with a bytes path gives bytes names
+        names = [entry[0] for entry in os.ilistdir(list_dir.encode())]
+        assert len(names) == file_count + 1 and all(isinstance(n, bytes) for n in names), (
+            "Test failed: Listing a bytes path did not return bytes names."
+        )
+
+        # Increment success count
+        success_count += 1
+
+    except (AssertionError, OSError) as e:
+        print(e)
+        fail_count += 1
+
+    finally:
+        # Cleanup
+        for name in file_names:
+            if path_exists(path_join(list_dir, name)):
+                os.remove(path_join(list_dir, name))
+        if path_exists(path_join(list_dir, sub_dir_name)):
+            os.rmdir(path_join(list_dir, sub_dir_name))
+        if path_exists(list_dir):
+            os.rmdir(list_dir)
+
+def test_preadv_and_pwritev(directory):
+    """Test writing a file from several buffers in one request and reading it back into several buffers."""
+    global success_count, fail_count
+
+    test_file = path_join(directory, "test_vectored.bin")
+    parts = [b"Whose woods these are ", b"I think I know.\n", b"His house is in the village though;\n"]
+    content = b"".join(parts)
+
+    try:
+        with open(test_file, "wb") as f:
+            written = f.pwritev(parts, 0)
+            assert written == len(content), f"Test failed: pwritev wrote {written} bytes, Expected: {len(content)}"
+            # Writing again in the middle replaces just those bytes
+            written = f.pwritev([b"THESE", b" ARE"], 12)
+            assert written == 9, f"Test failed: pwritev wrote {written} bytes, Expected: 9"
+        content = content[:12] + b"THESE ARE" + content[21:]
+
+        with open(test_file, "rb") as f:
+            assert f.read() == content, "Test failed: Content written with pwritev does not match."
+
+            buffers = [bytearray(5), bytearray(20), bytearray(len(content))]
+            read = f.preadv(buffers, 3)
+            assert read == len(content) - 3, f"Test failed: preadv read {read} bytes, Expected: {len(content) - 3}"
+            assert bytes(buffers[0]) == content[3:8], "Test failed: First preadv buffer does not match."
+            assert bytes(buffers[1]) == content[8:28], "Test failed: Second preadv buffer does not match."
+            # The read stops at the end of the file, part way through the last buffer
+            assert bytes(buffers[2][:len(content) - 28]) == content[28:], "Test failed: Last preadv buffer does not match."
+
+            # Reading from the end of the file gives nothing
+            assert f.preadv([bytearray(8)], len(content)) == 0, "Test failed: preadv past the end of the file read data."
+
+        # Increment success count
+        success_count += 1
+
+    except (AssertionError, OSError) as e:
+        print(e)
+        fail_count += 1
+
+    finally:
+        # Cleanup
+        if path_exists(test_file):
+            os.remove(test_file)
+
+def test_fetch(directory):
+    """Test that fetch stats a path and reads the start of a file in one request."""
+    global success_count, fail_count
+
+    small_file = path_join(directory, "test_fetch_small.txt")
+    big_file = path_join(directory, "test_fetch_big.txt")
+    small_content = b"And miles to go before I sleep."
+    big_content = generate_large_content(size_in_mb=1).encode()
+    # fetch reads at most this much of a file
+    fetch_max = 0x8000
+
+    try:
+        with open(small_file, "wb") as f:
+            f.write(small_content)
+        with open(big_file, "wb") as f:
+            f.write(big_content)
+
+        stat, data = asyncio.run(fs_async.fetch(small_file))
+        assert stat[6] == len(small_content), "Test failed: fetch returned the wrong size for a small file."
+        assert data == small_content, "Test failed: fetch returned the wrong data for a small file."
+
+        # A file larger than the fetch buffer has its full size in the stat but only its start read
+        stat, data = asyncio.run(fs_async.fetch(big_file))
+        assert stat[6] == len(big_content), "Test failed: fetch returned the wrong size for a large file."
+        assert data == big_content[:fetch_max], "Test failed: fetch returned the wrong data for a large file."
+
+        # A directory is only stat'ed
+        stat, data = asyncio.run(fs_async.fetch(directory))
+        assert stat[0] & 0xf000 == 0x4000, "Test failed: fetch of a directory did not return the directory type."
+        assert data == b"", "Test failed: fetch of a directory returned data."
+
+        # A missing path fails like stat does
+        try:
+            asyncio.run(fs_async.fetch(path_join(directory, "no_such_file")))
+        except OSError:
+            pass
+        else:
+            raise AssertionError("Test failed: fetch of a missing path did not raise OSError.")
+
+        # Increment success count
+        success_count += 1
+
+    except (AssertionError, OSError) as e:
+        print(e)
+        fail_count += 1
+
+    finally:
+        # Cleanup
+        for test_file in (small_file, big_file):
+            if path_exists(test_file):
+                os.remove(test_file)
+
+def test_allocate(directory):
+    """Test that allocate() grows files with zeros and rejects invalid arguments."""
+    global success_count, fail_count
+
+    empty_file = path_join(directory, "test_allocate_empty.bin")
+    grown_file = path_join(directory, "test_allocate_grown.bin")
+    head = b"Some data that must survive the allocation."
+    allocate_size = 256 * 1024
+
+    try:
+        # An empty file can be allocated in one go
+        with open(empty_file, "wb") as f:
+            f.allocate(0, allocate_size)
+        assert os.stat(empty_file)[6] == allocate_size, "Test failed: Empty file was not grown to the allocated size."
+        with open(empty_file, "rb") as f:
+            read_content = f.read()
+        assert read_content == bytes(allocate_size), "Test failed: Allocated part of the empty file is not zeroed."
+
+        # A file that already has data is grown from its end, keeping the data
+        with open(grown_file, "wb") as f:
+            f.write(head)
+            f.flush()
+            f.allocate(len(head), allocate_size)
+        expected_size = len(head) + allocate_size
+        assert os.stat(grown_file)[6] == expected_size, "Test failed: File was not grown to the allocated size."
+        with open(grown_file, "rb") as f:
+            read_content = f.read()
+        assert read_content == head + bytes(allocate_size), "Test failed: Allocated file content does not match."
+
+        # Allocating within the file leaves it as it is
+        with open(grown_file, "ab") as f:
+            f.allocate(0, len(head))
+        assert os.stat(grown_file)[6] == expected_size, "Test failed: Allocating within the file changed its size."
+
+        # Negative and empty ranges are refused without touching the file
+        with open(grown_file, "ab") as f:
+            for offset, length in ((-1, 16), (0, -16), (0, 0)):
+                try:
+                    f.allocate(offset, length)
+                except ValueError:
+                    continue
+                raise AssertionError(f"Test failed: allocate({offset}, {length}) did not raise ValueError.")
+        assert os.stat(grown_file)[6] == expected_size, "Test failed: Invalid allocation changed the file size."
+
+        # Increment success count
+        success_count += 1
+
+    except (AssertionError, OSError) as e:
+        print(e)
+        fail_count += 1
+
+    finally:
+        # Cleanup
+        for test_file in (empty_file, grown_file):
+            if path_exists(test_file):
+                os.remove(test_file)
+
+
+def test_large_write_over_dirty_blocks(directory):
+    """Test that a large write over blocks still dirty in the cache is not undone by writing them back."""
+    global success_count, fail_count
+
+    test_file = path_join(directory, "test_large_write_over_dirty.bin")
+    filler_file = path_join(directory, "test_large_write_filler.bin")
+    block_size = 4096
+    # Larger than the cache takes in with a single write, so the write goes straight to the device
+    file_size = 64 * block_size
+    rounds = 32
+    filler_chunk = bytes(256 * 1024)
+    # Larger than the block cache, reading it back pushes the test file out of the cache
+    filler_chunks = 20
+
+    try:
+        # Written in one go so the clusters are contiguous and later overwrites reach the disk as one write
+        with open(test_file, "wb") as f:
+            f.write(bytes(file_size))
+
+        # Repeat so that the flush timer goes off in the middle of some of the large writes
+        for r in range(rounds):
+            with open(test_file, "r+b") as f:
+                # Leave every block of the file dirty in the cache
+                for offset in range(0, file_size, block_size):
+                    f.seek(offset + 100)
+                    f.write(b"dirty")
+                f.seek(0)
+                f.write(bytes([r + 1]) * file_size)
+
+        with open(filler_file, "wb") as f:
+            for _ in range(filler_chunks):
+                f.write(filler_chunk)
+        with open(filler_file, "rb") as f:
+            while f.read(block_size):
+                pass
+
+        # What is read now comes from the device
+        with open(test_file, "rb") as f:
+            read_content = f.read()
+        assert read_content == bytes([rounds]) * file_size, \
+            "Test failed: Blocks written back after the large write overwrote its data."
+
+        # Increment success count
+        success_count += 1
+
+    except (AssertionError, OSError) as e:
+        print(e)
+        fail_count += 1
+
+    finally:
+        # Cleanup
+        for path in (test_file, filler_file):
+            if path_exists(path):
+                os.remove(path)
+
 
 def run_tests():
     test_dir_path = "/test_dir"
@@ -395,6 +663,31 @@ def run_tests():
 
     test_truncate_using_open_flag(test_dir_path)
 
+    # Indicate the start of the seventh test
+    print("\nTest 7: Running test_allocate")
+
+    test_allocate(test_dir_path)
+
+    # Indicate the start of the eighth test
+    print("\nTest 8: Running test_ilistdir_batches")
+
+    test_ilistdir_batches(test_dir_path)
+
+    # Indicate the start of the ninth test
+    print("\nTest 9: Running test_preadv_and_pwritev")
+
+    test_preadv_and_pwritev(test_dir_path)
+
+    # Indicate the start of the tenth test
+    print("\nTest 10: Running test_fetch")
+
+    test_fetch(test_dir_path)
+
+    # Indicate the start of the eleventh test
+    print("\nTest 11: Running test_large_write_over_dirty_blocks")
+
+    test_large_write_over_dirty_blocks(test_dir_path)
+
     # Print the results
     print(f"\nTests completed. Success: {success_count}, Fail: {fail_count}")
 
@@ -1,5 +1,7 @@
 # Copyright 2024, UNSW
 # SPDX-License-Identifier: BSD-2-Clause
 
+include("$(MPY_DIR)/extmod/asyncio/manifest.py")
+module("fs_async.py", base_path="$(PORT_DIR)")
 module("fs_test.py")
 module("bench.py")
@@ -9,11 +9,28 @@
 #include <sddf/blk/queue.h>
 #include <sddf/blk/storage_info.h>
 
+/*
+ * With FILEIO_ZERO_COPY the FAT server is given a second client connection whose data region is
+ * the region it shares with MicroPython, so that large aligned reads are written straight into the
+ * client's buffer. Both connections access the same partition.
+ */
+#ifdef FILEIO_ZERO_COPY
+#define BLK_NUM_CLIENTS 2
+#else
 #define BLK_NUM_CLIENTS 1
+#endif
 
 #define BLK_NAME_CLI0                      "fat"
 
-#define BLK_QUEUE_CAPACITY_CLI_FAT              16
+/*
+ * Each FAT worker thread keeps up to FAT_BLK_REQUESTS_PER_THREAD (4) requests in flight, and read-ahead
+ * uses up to FAT_READAHEAD_SLOTS (4) more, so the queues grow with the number of worker threads.
+ */
+#ifndef FAT_WORKER_THREAD_NUM
+#define FAT_WORKER_THREAD_NUM 4
+#endif
+#define BLK_QUEUE_CAPACITY_CLI_FAT              (FAT_WORKER_THREAD_NUM * 8)
+#define BLK_QUEUE_CAPACITY_CLI_FAT_ZERO_COPY    (FAT_WORKER_THREAD_NUM * 4)
 #define BLK_QUEUE_CAPACITY_CLI0                 BLK_QUEUE_CAPACITY_CLI_FAT
 #define BLK_QUEUE_CAPACITY_DRIV                 1024
 
@@ -26,19 +43,44 @@
 #define BLK_QUEUE_REGION_SIZE_CLI0          BLK_REGION_SIZE
 #define BLK_QUEUE_REGION_SIZE_DRIV          BLK_REGION_SIZE
 
+#ifdef FILEIO_ZERO_COPY
+#define BLK_QUEUE_CAPACITY_CLI1                 BLK_QUEUE_CAPACITY_CLI_FAT_ZERO_COPY
+#define BLK_CONFIG_REGION_SIZE_CLI1         BLK_REGION_SIZE
+#ifdef FILEIO_FS_VIRT
+/* Must match the FAT server's data region, which covers the data regions of both fs clients */
+#define BLK_DATA_REGION_SIZE_CLI1           FILEIO_FS_DATA_REGION_SIZE
+#else
+/* Must match the size of the shared_fs_micropython memory region */
+#define BLK_DATA_REGION_SIZE_CLI1           0x4000000
+#endif
+#define BLK_QUEUE_REGION_SIZE_CLI1          BLK_REGION_SIZE
+#endif
+
 _Static_assert(BLK_DATA_REGION_SIZE_CLI0 >= BLK_TRANSFER_SIZE && BLK_DATA_REGION_SIZE_CLI0 % BLK_TRANSFER_SIZE == 0,
                "Client0 data region size must be a multiple of the transfer size");
 _Static_assert(BLK_DATA_REGION_SIZE_DRIV >= BLK_TRANSFER_SIZE && BLK_DATA_REGION_SIZE_DRIV % BLK_TRANSFER_SIZE == 0,
                "Driver data region size must be a multiple of the transfer size");
+#ifdef FILEIO_ZERO_COPY
+_Static_assert(BLK_DATA_REGION_SIZE_CLI1 >= BLK_TRANSFER_SIZE && BLK_DATA_REGION_SIZE_CLI1 % BLK_TRANSFER_SIZE == 0,
+               "Client1 data region size must be a multiple of the transfer size");
+#endif
 
 /* Mapping from client index to disk partition that the client will have access to. */
+#ifdef FILEIO_ZERO_COPY
+static const int blk_partition_mapping[BLK_NUM_CLIENTS] = { 0, 0 };
+#else
 static const int blk_partition_mapping[BLK_NUM_CLIENTS] = { 0 };
+#endif
 
 static inline blk_storage_info_t *blk_virt_cli_storage_info(blk_storage_info_t *info, unsigned int id)
 {
     switch (id) {
     case 0:
         return info;
+#ifdef FILEIO_ZERO_COPY
+    case 1:
+        return (blk_storage_info_t *)((uintptr_t)info + BLK_CONFIG_REGION_SIZE_CLI0);
+#endif
     default:
         return NULL;
     }
@@ -49,6 +91,10 @@ static inline uintptr_t blk_virt_cli_data_region(uintptr_t data, unsigned int id
     switch (id) {
     case 0:
         return data;
+#ifdef FILEIO_ZERO_COPY
+    case 1:
+        return data + BLK_DATA_REGION_SIZE_CLI0;
+#endif
     default:
         return 0;
     }
@@ -59,6 +105,10 @@ static inline uint64_t blk_virt_cli_data_region_size(unsigned int id)
     switch (id) {
     case 0:
         return BLK_DATA_REGION_SIZE_CLI0;
+#ifdef FILEIO_ZERO_COPY
+    case 1:
+        return BLK_DATA_REGION_SIZE_CLI1;
+#endif
     default:
         return 0;
     }
@@ -69,6 +119,10 @@ static inline blk_req_queue_t *blk_virt_cli_req_queue(blk_req_queue_t *req, unsi
     switch (id) {
     case 0:
         return req;
+#ifdef FILEIO_ZERO_COPY
+    case 1:
+        return (blk_req_queue_t *)((uintptr_t)req + BLK_QUEUE_REGION_SIZE_CLI0);
+#endif
     default:
         return NULL;
     }
@@ -79,6 +133,10 @@ static inline blk_resp_queue_t *blk_virt_cli_resp_queue(blk_resp_queue_t *resp,
     switch (id) {
     case 0:
         return resp;
+#ifdef FILEIO_ZERO_COPY
+    case 1:
+        return (blk_resp_queue_t *)((uintptr_t)resp + BLK_QUEUE_REGION_SIZE_CLI0);
+#endif
     default:
         return NULL;
     }
@@ -89,6 +147,10 @@ static inline uint32_t blk_virt_cli_queue_capacity(unsigned int id)
     switch (id) {
     case 0:
         return BLK_QUEUE_CAPACITY_CLI0;
+#ifdef FILEIO_ZERO_COPY
+    case 1:
+        return BLK_QUEUE_CAPACITY_CLI1;
+#endif
     default:
         return 0;
     }
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2024, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Second file system client of the fileio example, sharing the FAT server with MicroPython
+ * through the fs virtualiser. It writes a file, reads it back and checks its contents, then
+ * removes it, for FS_CLIENT_ROUNDS rounds. This runs alongside whatever MicroPython is doing,
+ * so the server sees commands from both clients at once.
+ */
+
+#include <microkit.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/util/printf.h>
+#include <lions/fs/protocol.h>
+
+#define FS_CH 0
+
+#define FS_CLIENT_PATH "/fs_client.bin"
+#define FS_CLIENT_FILE_SIZE 0x100000
+#define FS_CLIENT_CHUNK_SIZE 0x10000
+#define FS_CLIENT_ROUNDS 8
+
+// Layout of the data region shared with the fs virtualiser
+#define PATH_OFFSET 0
+#define DATA_OFFSET 0x10000
+
+fs_queue_t *fs_command_queue;
+fs_queue_t *fs_completion_queue;
+char *fs_share;
+
+static enum {
+    STEP_INITIALISE,
+    STEP_OPEN,
+    STEP_WRITE,
+    STEP_READ,
+    STEP_CLOSE,
+    STEP_REMOVE,
+    STEP_DONE,
+} step;
+
+static uint64_t cur_round;
+static uint64_t fd;
+// Position in the file of the chunk being written or read
+static uint64_t pos;
+static uint64_t path_len;
+
+static inline uint8_t pattern(uint64_t offset) {
+    return (uint8_t)((offset >> 12) + offset + cur_round * 7);
+}
+
+static void send_command(uint64_t type, fs_cmd_params_t params) {
+    fs_cmd_t cmd = { .id = step, .type = type, .params = params };
+    fs_queue_idx_empty(fs_command_queue, 0)->cmd = cmd;
+    fs_queue_publish_production(fs_command_queue, 1);
+    microkit_notify(FS_CH);
+}
+
+static void send_step(void) {
+    fs_buffer_t path = { .offset = PATH_OFFSET, .size = path_len };
+    fs_buffer_t data = { .offset = DATA_OFFSET, .size = FS_CLIENT_CHUNK_SIZE };
+
+    switch (step) {
+    case STEP_INITIALISE:
+        send_command(FS_CMD_INITIALISE, (fs_cmd_params_t){0});
+        break;
+    case STEP_OPEN:
+        send_command(FS_CMD_FILE_OPEN, (fs_cmd_params_t){
+            .file_open = { .path = path, .flags = FS_OPEN_FLAGS_READ_WRITE | FS_OPEN_FLAGS_CREATE },
+        });
+        break;
+    case STEP_WRITE:
+        for (uint64_t i = 0; i < FS_CLIENT_CHUNK_SIZE; i++) {
+            fs_share[DATA_OFFSET + i] = pattern(pos + i);
+        }
+        send_command(FS_CMD_FILE_WRITE, (fs_cmd_params_t){
+            .file_write = { .fd = fd, .offset = pos, .buf = data },
+        });
+        break;
+    case STEP_READ:
+        send_command(FS_CMD_FILE_READ, (fs_cmd_params_t){
+            .file_read = { .fd = fd, .offset = pos, .buf = data },
+        });
+        break;
+    case STEP_CLOSE:
+        send_command(FS_CMD_FILE_CLOSE, (fs_cmd_params_t){ .file_close = { .fd = fd } });
+        break;
+    case STEP_REMOVE:
+        send_command(FS_CMD_FILE_REMOVE, (fs_cmd_params_t){ .file_remove = { .path = path } });
+        break;
+    case STEP_DONE:
+        break;
+    }
+}
+
+static bool check_chunk(uint64_t len) {
+    if (len != FS_CLIENT_CHUNK_SIZE) {
+        sddf_printf("FS_CLIENT|ERROR: round %lu: short read of %lu bytes at %lu\n", cur_round, len, pos);
+        return false;
+    }
+    for (uint64_t i = 0; i < FS_CLIENT_CHUNK_SIZE; i++) {
+        if ((uint8_t)fs_share[DATA_OFFSET + i] != pattern(pos + i)) {
+            sddf_printf("FS_CLIENT|ERROR: round %lu: data mismatch at %lu\n", cur_round, pos + i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Move on to the next step once the previous one has completed
+static void handle_completion(fs_cmpl_t cmpl) {
+    if (cmpl.status != FS_STATUS_SUCCESS) {
+        sddf_printf("FS_CLIENT|ERROR: round %lu: step %lu failed: %s\n", cur_round, cmpl.id,
+                    fs_status_to_str(cmpl.status));
+        step = STEP_DONE;
+        return;
+    }
+
+    switch (step) {
+    case STEP_INITIALISE:
+        step = STEP_OPEN;
+        break;
+    case STEP_OPEN:
+        fd = cmpl.data.file_open.fd;
+        pos = 0;
+        step = STEP_WRITE;
+        break;
+    case STEP_WRITE:
+        pos += FS_CLIENT_CHUNK_SIZE;
+        if (pos == FS_CLIENT_FILE_SIZE) {
+            pos = 0;
+            step = STEP_READ;
+        }
+        break;
+    case STEP_READ:
+        if (!check_chunk(cmpl.data.file_read.len_read)) {
+            step = STEP_DONE;
+            return;
+        }
+        pos += FS_CLIENT_CHUNK_SIZE;
+        if (pos == FS_CLIENT_FILE_SIZE) {
+            step = STEP_CLOSE;
+        }
+        break;
+    case STEP_CLOSE:
+        step = STEP_REMOVE;
+        break;
+    case STEP_REMOVE:
+        sddf_printf("FS_CLIENT|INFO: round %lu passed\n", cur_round);
+        cur_round++;
+        step = (cur_round == FS_CLIENT_ROUNDS) ? STEP_DONE : STEP_OPEN;
+        break;
+    case STEP_DONE:
+        return;
+    }
+    send_step();
+}
+
+void notified(microkit_channel ch) {
+    if (ch != FS_CH) {
+        sddf_printf("FS_CLIENT|ERROR: notification on unknown channel %u\n", ch);
+        return;
+    }
+    uint64_t count = fs_queue_length_consumer(fs_completion_queue);
+    for (uint64_t i = 0; i < count; i++) {
+        handle_completion(fs_queue_idx_filled(fs_completion_queue, i)->cmpl);
+    }
+    fs_queue_publish_consumption(fs_completion_queue, count);
+}
+
+void init(void) {
+    const char *path = FS_CLIENT_PATH;
+    for (path_len = 0; path[path_len] != '\0'; path_len++) {
+        fs_share[PATH_OFFSET + path_len] = path[path_len];
+    }
+    step = STEP_INITIALISE;
+    send_step();
+}
@@ -20,9 +20,16 @@ content_types_map = Response.types_map | {
 # wrapper uses a fixed buffer size for reading from the file, which is
 # suboptimal. Hence we implement our own class which uses a better
 # buffer size.
+#
+# The start of the file has already been read by send_file() as part
+# of the fetch, so that is sent first. Only files that did not fit in
+# the fetch buffer are opened and read the usual way.
 class FileStream:
-    def __init__(self, path):
+    def __init__(self, path, head, complete):
         self.path = path
+        self.head = head
+        self.complete = complete
+        self.pos = len(head)
         self.f = None
 
     def __aiter__(self):
@@ -30,14 +37,23 @@ class FileStream:
 
     async def __anext__(self):
         if self.f is None:
+            if self.head is not None:
+                buf = self.head
+                self.head = None
+                if len(buf) != 0:
+                    return buf
+            if self.complete:
+                raise StopAsyncIteration
             self.f = await fs_async.open(self.path)
+            self.f.pos = self.pos
         buf = await self.f.read(0x8000)
         if len(buf) == 0:
             raise StopAsyncIteration
         return buf
 
     async def aclose(self):
-        await self.f.close()
+        if self.f is not None:
+            await self.f.close()
 
 
 def parse_http_date(date_str):
@@ -82,6 +98,8 @@ async def resolve(relative_path):
     def is_dir(stat):
         return stat[0] & 0o170000 == 0o40000
 
+    # Candidates are only stat'ed. The file that is finally served is
+    # fetched by send_file(), and only if the client needs its body.
     async def try_stat(path):
         try:
             return await fs_async.stat(path)
@@ -175,12 +193,21 @@ async def send_file(relative_path, request_headers):
     except:
         pass # malformed If-Modified-Since header should be ignored
 
+    # Small files are read whole by the fetch and never have to be
+    # opened. The fetched stat is used from here on, so the headers match the
+    # data even if the file changed since it was resolved.
+    try:
+        stat, data = await fs_async.fetch(path)
+    except:
+        return Response(status_code=404, reason='Not Found')
+    mtime = stat[8]
+
     length = stat[6]
     response_headers['Content-Length'] = f'{length}'
 
     response_headers['Last-Modified'] = format_http_date(mtime)
 
-    return Response(body=FileStream(path), headers=response_headers)
+    return Response(body=FileStream(path, data, len(data) >= length), headers=response_headers)
 
 
 app = Microdot()
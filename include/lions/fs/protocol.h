@@ -13,6 +13,9 @@
 #define FS_MAX_NAME_LENGTH 255
 #define FS_MAX_PATH_LENGTH 4095
 
+// maximum number of buffers that can be described by a vectored read or write
+#define FS_MAX_IOV 64
+
 // flags to control the behaviour of the open command
 enum {
     FS_OPEN_FLAGS_READ_ONLY = 0,
@@ -92,6 +95,11 @@ enum {
     FS_CMD_DIR_SEEK,
     FS_CMD_DIR_TELL,
     FS_CMD_DIR_REWIND,
+    FS_CMD_FILE_READV,
+    FS_CMD_FILE_WRITEV,
+    FS_CMD_FILE_FETCH,
+    FS_CMD_DIR_READ_BATCH,
+    FS_CMD_FILE_ALLOCATE,
 
     // the number of different types of command
     FS_NUM_COMMANDS
@@ -117,6 +125,16 @@ typedef struct fs_stat {
     uint64_t used;
 } fs_stat_t;
 
+// Entries returned by FS_CMD_DIR_READ_BATCH are packed back to back in the output buffer.
+// Each one is an fs_dirent_t followed by name_len bytes of name (not NUL terminated),
+// the next entry begins FS_DIRENT_SIZE(name_len) bytes after the start of this one.
+typedef struct fs_dirent {
+    fs_stat_t stat;
+    uint64_t name_len;
+} fs_dirent_t;
+
+#define FS_DIRENT_SIZE(name_len) ((sizeof (fs_dirent_t) + (name_len) + 7) & ~(uint64_t)7)
+
 typedef struct fs_buffer {
     uint64_t offset;
     uint64_t size;
@@ -204,6 +222,47 @@ typedef struct fs_cmd_params_dir_rewind {
     uint64_t fd;
 } fs_cmd_params_dir_rewind_t;
 
+// The iov buffer refers to an array of fs_buffer_t in the shared data region,
+// iov.size must be a multiple of sizeof (fs_buffer_t) and describe at most FS_MAX_IOV entries.
+// Buffers are filled in order starting at offset, a short read ends the command.
+typedef struct fs_cmd_params_file_readv {
+    uint64_t fd;
+    uint64_t offset;
+    fs_buffer_t iov;
+} fs_cmd_params_file_readv_t;
+
+// Same layout as fs_cmd_params_file_readv_t, buffers are written out in order starting at offset.
+typedef struct fs_cmd_params_file_writev {
+    uint64_t fd;
+    uint64_t offset;
+    fs_buffer_t iov;
+} fs_cmd_params_file_writev_t;
+
+// Stat path into the stat buffer and, if it is a regular file, read it from the start into buf.
+// The file is opened and closed by the server, so no fd is ever handed out.
+// For a directory only the stat buffer is filled in and len_read is 0.
+typedef struct fs_cmd_params_file_fetch {
+    fs_buffer_t path;
+    fs_buffer_t stat;
+    fs_buffer_t buf;
+} fs_cmd_params_file_fetch_t;
+
+// Fill buf with as many directory entries as fit, continuing from the current position of fd.
+// The buffer must be large enough to hold at least one entry of the maximum name length.
+typedef struct fs_cmd_params_dir_read_batch {
+    uint64_t fd;
+    fs_buffer_t buf;
+} fs_cmd_params_dir_read_batch_t;
+
+// Allocate space for the file up to offset + length, growing it to that size if it is shorter.
+// The added part reads as zeros. If the space cannot be allocated, the file is left at its old size.
+// The server allocates the space contiguously where it can, which is most likely for an empty file.
+typedef struct fs_cmd_params_file_allocate {
+    uint64_t fd;
+    uint64_t offset;
+    uint64_t length;
+} fs_cmd_params_file_allocate_t;
+
 typedef union fs_cmd_params {
     fs_cmd_params_file_open_t file_open;
     fs_cmd_params_file_close_t file_close;
@@ -223,6 +282,11 @@ typedef union fs_cmd_params {
     fs_cmd_params_dir_seek_t dir_seek;
     fs_cmd_params_dir_tell_t dir_tell;
     fs_cmd_params_dir_rewind_t dir_rewind;
+    fs_cmd_params_file_readv_t file_readv;
+    fs_cmd_params_file_writev_t file_writev;
+    fs_cmd_params_file_fetch_t file_fetch;
+    fs_cmd_params_dir_read_batch_t dir_read_batch;
+    fs_cmd_params_file_allocate_t file_allocate;
 
     uint8_t min_size[48];
 } fs_cmd_params_t;
@@ -262,6 +326,26 @@ typedef struct fs_cmpl_data_dir_tell {
     uint64_t location;
 } fs_cmpl_data_dir_tell_t;
 
+typedef struct fs_cmpl_data_file_readv {
+    uint64_t len_read;
+} fs_cmpl_data_file_readv_t;
+
+typedef struct fs_cmpl_data_file_writev {
+    uint64_t len_written;
+} fs_cmpl_data_file_writev_t;
+
+typedef struct fs_cmpl_data_file_fetch {
+    uint64_t len_read;
+} fs_cmpl_data_file_fetch_t;
+
+// cookie is the directory position after the last entry returned, as reported by FS_CMD_DIR_TELL
+// and accepted by FS_CMD_DIR_SEEK. Reaching the end of the directory with no entries
+// returned completes with FS_STATUS_END_OF_DIRECTORY.
+typedef struct fs_cmpl_data_dir_read_batch {
+    uint64_t num_entries;
+    uint64_t cookie;
+} fs_cmpl_data_dir_read_batch_t;
+
 typedef union fs_cmpl_data {
     fs_cmpl_data_file_open_t file_open;
     fs_cmpl_data_file_read_t file_read;
@@ -270,6 +354,10 @@ typedef union fs_cmpl_data {
     fs_cmpl_data_dir_open_t dir_open;
     fs_cmpl_data_dir_read_t dir_read;
     fs_cmpl_data_dir_tell_t dir_tell;
+    fs_cmpl_data_file_readv_t file_readv;
+    fs_cmpl_data_file_writev_t file_writev;
+    fs_cmpl_data_file_fetch_t file_fetch;
+    fs_cmpl_data_dir_read_batch_t dir_read_batch;
 } fs_cmpl_data_t;
 
 typedef struct fs_cmpl {